@@ -1,70 +1,29 @@
-#include <fstream>
-#include <iostream>
-#include <vector>
 #include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <utility>
 #include <chrono>
+#include <thread>
 
-#include "src/brdf.h"
 #include "src/concurrency.h"
+#include "src/environment.h"
 #include "src/gltf.h"
+#include "src/image.h"
+#include "src/render.h"
 #include "src/scene.h"
+#include "src/timeline.h"
 #include "src/utils.h"
 #include "src/vector.h"
 
-float srgb(float x) { return std::pow(x, 1.f / 2.2f); }
-
-Vector3 tonemapping(const Vector3 &color) 
-{
-  return Vector3(std::min(1.0f, color.x()), std::min(1.0f, color.y()),
-                 std::min(1.0f, color.z()));
-}
-
-Vector3 tonemappingUncharted(const Vector3 &color) {
-  const Vector3 A = Vector3(0.15f, 0.15f, 0.15f);
-  const Vector3 B = Vector3(0.50f, 0.50f, 0.50f);
-  const Vector3 C = Vector3(0.10f, 0.10f, 0.10f);
-  const Vector3 D = Vector3(0.20f, 0.20f, 0.20f);
-  const Vector3 E = Vector3(0.02f, 0.02f, 0.02f);
-  const Vector3 F = Vector3(0.30f, 0.30f, 0.30f);
-  const Vector3 wPoint = Vector3(11.20f, 11.30f, 11.20f);
-
-  auto applay = [&](const Vector3 &c) {
-    return ((c * (A * c + C * B) + D * E) / (c * (A * c + B) + D * F)) - E / F;
-  };
-
-  return applay(color) * (Vector3(1.0, 1.0f, 1.0f) / applay(wPoint));
-}
-
-void saveImageToFile(std::uint16_t width, std::uint16_t height,
-                     const std::vector<Vector3> &data) {
-  std::ofstream outfile("output.ppm", std::ios::out | std::ios::binary);
-
-  if (outfile.is_open()) {
-    outfile << "P3\n" << width << " " << height << "\n255\n";
-
-    for (int y = 0; y < height; ++y) {
-      for (int x = 0; x < width; ++x) {
-        Vector3 color = tonemappingUncharted(data[y * width + x]);
-        int r = (int)std::clamp(srgb(color.x()) * 255, 0.0f, 255.0f); // R
-        int g = (int)std::clamp(srgb(color.y()) * 255, 0.0f, 255.0f); // G
-        int b = (int)std::clamp(srgb(color.z()) * 255, 0.0f, 255.0f); // B
-
-        outfile << r << " " << g << " " << b << " ";
-      }
-      outfile << "\n";
-    }
-    outfile.close();
-
-    // Сообщаем о сохранении
-    printf("Image saved to output.ppm\n");
-  } else {
-    printf("Error: Could not open output.ppm for writing.\n");
-  }
-}
-
 // можно использовать точку и дистанцию
 float intersectPlane(const math::Ray &ray, Vector3 poinOnPlane,
-                     Vector3 normPlane, float tMin, float tMax) 
+                     Vector3 normPlane, float tMin, float tMax)
 {
   float t = dot((poinOnPlane - ray.origin), normPlane) /
             dot(ray.direction, normPlane);
@@ -75,236 +34,19 @@ float intersectPlane(const math::Ray &ray, Vector3 poinOnPlane,
   }
 }
 
-// Vector3 getUniformSampleOffset( int index, int side_count )
-//{
-//	const float haflDist = 0.5 / side_count;
-//	const float dist = 1.0 / side_count;
-//	const float x = index % side_count;
-//	const float y = std::floor( index / side_count );
-//	return Vector3( haflDist + x * dist, haflDist + y * dist, 0.0 );
-// }
-
-Vector3 getUniformSampleOffset(int index, int side_count) 
-{
-  const float x_idx = (float)(index % side_count);
-  const float y_idx = (float)std::floor(index / side_count);
-
-  const float dist = 1.0f / side_count;
-
-  const float jitterX = randomFloat();
-  const float jitterY = randomFloat();
-
-  const float u = (x_idx + jitterX) * dist;
-  const float v = (y_idx + jitterY) * dist;
-
-  return Vector3(u, v, 0.0f);
-}
-
-Vector3 randomUniformVectorHemispher() 
-{
-  const float phi = randFloat(0, 1) * 2.0f * PI;
-  const float cosTheta = randFloat(0, 1) * 2.0f - 1.0f;
-  const float sinTheta = std::sqrt(1 - cosTheta * cosTheta);
-  const float x = std::cos(phi) * sinTheta;
-  const float y = cosTheta;
-  const float z = std::sin(phi) * sinTheta;
-  return Vector3(x, y, z);
-}
-
-Vector3 randOnHemispher(const Vector3 &normal) 
-{
-  Vector3 onSphere = randUnitVector();
-  if (dot(onSphere, normal) > 0.0f)
-    return onSphere;
-  else
-    return -onSphere;
-}
-
-Vector3 reflect(const Vector3 &d, const Vector3 &n) 
-{
-  return d - 2.0f * dot(d, n) * n;
-}
-
-Vector3 trace(const math::Ray &ray, const Scene &scene, int depth) 
-{
-  const float tMin = 0.1f;
-  float tMax = 10000;
-  Vector3 hitNormal;
-
-  int matIndex = -1;
-
-  math::Triangle tr;
-  float t = scene.intersect(ray, tMin, tMax, tr);
-  if (t < tMax) {
-    tMax = t;
-    matIndex = tr.matIndex;
-
-    // Calculate barycentric coordinates for normal interpolation
-    const Vector3 p = ray.origin + ray.direction * tMax;
-    const Vector3 v0 = tr.b - tr.a;
-    const Vector3 v1 = tr.c - tr.a;
-    const Vector3 v2 = p - tr.a;
-
-    const float d00 = dot(v0, v0);
-    const float d01 = dot(v0, v1);
-    const float d11 = dot(v1, v1);
-    const float d20 = dot(v2, v0);
-    const float d21 = dot(v2, v1);
-
-    const float denom = d00 * d11 - d01 * d01;
-    if (std::abs(denom) < 1e-8f) {
-      hitNormal = unit_vector(cross(v0, v1));
-    } else {
-      const float v = (d11 * d20 - d01 * d21) / denom;
-      const float w = (d00 * d21 - d01 * d20) / denom;
-      const float u = 1.0f - v - w;
-
-      hitNormal = unit_vector(u * tr.na + v * tr.nb + w * tr.nc);
-    }
-  }
-  if (tMax == 10000 || matIndex == -1)
-    return Vector3(0.f, 0.f, 0.f); // scene.enviroment();
-
-  if (dot(hitNormal, ray.direction) > 0.0)
-    hitNormal = -hitNormal;
-
-  const Material m = scene.materials()[matIndex];
-
-  // float probToContinue = 0.5;// std::min(0.9f, std::max( 1e-3f, std::max(
-  // m.albedo.x(), std::max( m.albedo.y(), m.albedo.z() ) )));
-  const float probToContinue =
-      std::max(m.albedo.x(), std::max(m.albedo.y(), m.albedo.z()));
-  const int maxDepth = 10;
-  if (depth > maxDepth && (randFloat(0, 1) > probToContinue))
-    return m.emission;
-
-  Vector3 color;
-
-  auto newDir = randomUniformVectorHemispher();
-  float cosTheta = dot(newDir, hitNormal);
-  if (cosTheta < 0.0) {
-    newDir *= -1;
-    cosTheta *= -1;
-  }
-  const Vector3 newOrig = ray.origin + ray.direction * tMax + newDir * 1e-4f;
-  const math::Ray newRay({newOrig, newDir});
-
-  // float brdf = 1.0f / PI;
-  // float pdf = 1.0f / ( 2.0f * PI );
-  const Vector3 L = newDir;
-  const Vector3 V = ray.direction * -1.0f;
-  const Vector3 H = unit_vector((L + V) * 0.5f);
-  const Vector3 N = hitNormal;
-  auto brdf = BRDF(m.albedo, m.metallic, m.roughness, L, H, N, V);
-  float pdf = 1.0f / (2.0f * PI);
-
-  color = trace(newRay, scene, depth + 1) * brdf * cosTheta / pdf + m.emission;
-
-  if (depth > maxDepth)
-    return color * (1.0f / probToContinue);
-
-  return color;
-}
-
-// Vector3 trace_iterative( math::Ray ray, const Scene& scene, int maxDepth)
-//{
-//	Vector3 throughput = Vector3(1.0, 1.0, 1.0);
-//	Vector3 radiance = Vector3(0.0, 0.0, 0.0);
-//
-//	const float tMin = 0.001f;
-//
-//	for (int depth = 0; depth < maxDepth; ++depth)
-//	{
-//		float tMax = 10000.0f;
-//		float t;
-//		Vector3 hitNormal;
-//		int matIndex = -1;
-//
-//
-//		for (const auto& sp : scene.spheres())
-//		{
-//			t = math::intersect(ray, sp, tMin, tMax);
-//			if (t < tMax)
-//			{
-//				Vector3 pos = ray.origin + ray.direction * t;
-//				hitNormal = unit_vector(pos - sp.pos);
-//				tMax = t;
-//				matIndex = sp.matIndex;
-//			}
-//		}
-//
-//		for (const auto& p : scene.planes())
-//		{
-//			t = intersectPlane2(ray, p.normal, p.dist, tMin, tMax);
-//			if (t < tMax)
-//			{
-//				hitNormal = p.normal;
-//				tMax = t;
-//				matIndex = p.matIndex;
-//			}
-//		}
-//
-//		for (const auto& tr : scene.triangles())
-//		{
-//			t = math::intersect(ray, tr, tMin, tMax);
-//			if (t < tMax)
-//			{
-//				hitNormal = unit_vector(cross(tr.b - tr.a, tr.c
-//- tr.a)); 				tMax = t;
-//matIndex = tr.matIndex;
-//			}
-//		}
-//
-//		if (matIndex == -1 || tMax == 10000.0f) // matIndex == -1 -
-// более явная проверка на промах
-//		{
-//			radiance += throughput * scene.enviroment();
-//			break;
-//		}
-//
-//		if (dot(hitNormal, ray.direction) > 0.0)
-//			hitNormal = -hitNormal;
-//
-//
-//		Vector3 newDir = randomUniformVectorHemispher();
-//
-//		auto cosTheta = dot(newDir, hitNormal);
-//		if (cosTheta < 0.0)
-//			newDir *= -1;
-//
-//		cosTheta = dot(newDir, hitNormal);
-//
-//		const Material m = scene.materials()[matIndex];
-//
-//
-//		radiance += throughput * m.emission;
-//
-//		const float brdf = 1.0f / PI;
-//		const float pdf = 1.0f / (2.0f * PI);
-//
-//		throughput = throughput * m.albedo * (brdf * cosTheta / pdf);
-//
-//
-//		const Vector3 newOrig = ray.origin + ray.direction * tMax +
-// newDir * 1e-4f;
-//
-//		ray.origin = newOrig;
-//		ray.direction = newDir;
-//	}
-//
-//	return radiance;
-// }
-
-std::atomic<int> completed_pixels(0);
-
-void display_progress(int total_pixels) {
+void display_progress(const Renderer &renderer) {
   const int BAR_LENGTH = 50;
   int last_percentage = -1;
 
-  while (completed_pixels.load() < total_pixels) {
-    int current = completed_pixels.load();
+  while (!renderer.finished()) {
+    const StatsSnapshot stats = renderer.stats();
+    long long current = (long long)stats[Stat::Samples];
+    const double mrays = std::round(stats.rays() /
+                                    std::max(renderer.elapsedSeconds(), 1e-3f) *
+                                    1e-4) /
+                         100.0;
 
-    int percentage = (current * 100) / total_pixels;
+    int percentage = (int)(renderer.progress() * 100);
     int filled_length = (percentage * BAR_LENGTH) / 100;
 
     if (percentage > last_percentage) {
@@ -318,8 +60,8 @@ void display_progress(int total_pixels) {
         std::cout << " ";
       }
 
-      std::cout << "] " << percentage << "% (" << current << "/" << total_pixels
-                << ")";
+      std::cout << "] " << percentage << "% (" << current << " samples, "
+                << mrays << " Mrays/s)";
       std::cout.flush();
       last_percentage = percentage;
     }
@@ -330,86 +72,379 @@ void display_progress(int total_pixels) {
   std::cout << "\r[";
   for (int i = 0; i < BAR_LENGTH; ++i)
     std::cout << "#";
-  std::cout << "] 100% (" << total_pixels << "/" << total_pixels << ")\n";
+  std::cout << "] 100% (" << renderer.completedSamples() << " samples)\n";
   std::cout.flush();
 }
 
-int main() {
-  Scene scene;
-  gltf::parse("../scenes/07-scene-easy.gltf", scene);
-  //gltf::parse("../scenes/07-scene-medium-2.gltf", scene);
+void printUsage() {
+  std::cout
+      << "Usage: pbr [options]\n"
+         "  --scene <file.gltf>     scene to render\n"
+         "  --env <file.pfm|hdr>    equirectangular environment light\n"
+         "  --env-intensity <s>     environment radiance scale (default 1)\n"
+         "  --width <pixels>        image width (default 600)\n"
+         "  --spp-side <n>          n*n samples per pixel (default 8)\n"
+         "  --threads <n>           worker threads (default: one per CPU)\n"
+         "  --pin-threads           bind each worker thread to one core\n"
+         "  --tile-size <n>         tile edge in pixels (default 16)\n"
+         "  --viewport <x0,y0,x1,y1> render tiles in this pixel rectangle "
+         "first\n"
+         "  --cancel-after <s>      cancel the render after s seconds, as an\n"
+         "                          interactive edit would; no images are\n"
+         "                          written\n"
+         "  --stats-json <file>     write ray counts, rates and worker\n"
+         "                          utilisation as JSON\n"
+         "  --trace <file.json>     record a timeline of loading, BVH builds,\n"
+         "                          tiles and image output for Perfetto\n"
+         "  --cost-map <metric>     write nodes, triangles, path-length or\n"
+         "                          time per sample instead of radiance,\n"
+         "                          false coloured plus a raw _cost.pfm\n"
+         "  --adaptive              spend the sample budget where the noise "
+         "is\n"
+         "  --adaptive-threshold <e> relative error of a converged pixel\n"
+         "  --adaptive-initial <n>  samples of the initial pass\n"
+         "  --adaptive-round <n>    samples per pixel and round\n"
+         "  --adaptive-max <n>      sample cap of a single pixel\n"
+         "  --progressive           render passes until a limit is hit\n"
+         "  --time-budget <s>       wall-clock limit in seconds (0 = none)\n"
+         "  --noise-target <e>      stop at this mean relative error\n"
+         "  --max-passes <n>        stop after n passes (0 = none)\n"
+         "  --pass-samples <n>      samples per pixel and pass\n"
+         "  --flush-interval <s>    write the current image every s seconds\n"
+         "  --output <file.ppm>     output image (default output.ppm)\n"
+         "  --no-nee                disable direct light sampling\n"
+         "  --restir                resample direct light at the first hit\n"
+         "  --restir-candidates <n> light candidates per pixel (default 32)\n"
+         "  --restir-spatial <n>    neighbour reservoirs reused (default 4)\n"
+         "  --restir-radius <px>    neighbour search radius (default 6)\n"
+         "  --guiding               learn and sample incident radiance\n"
+         "                          (progressive mode)\n"
+         "  --guiding-bsdf <p>      BRDF sampling probability (default 0.5)\n"
+         "  --guiding-memory <MB>   guiding memory bound (default 32)\n"
+         "  --radiance-cache        end deep paths in a learned radiance cache\n"
+         "  --cache-depth <n>       bounces before a path may end (default 3)\n"
+         "  --cache-memory <MB>     radiance cache memory bound (default 16)\n"
+         "  --wavefront             batched stage-by-stage path tracing\n"
+         "  --batch-size <n>        paths per wavefront batch\n"
+         "  --sort-rays             sort secondary wavefront rays for coherence\n"
+         "  --sort-batch <n>        rays sorted together (default 65536)\n"
+         "  --sort-bench            also trace unsorted to measure the speedup\n"
+         "  --aov                   write albedo, normal, depth and variance\n"
+         "                          next to the output\n"
+         "  --denoise               write a denoised image next to the output\n"
+         "  --denoise-iterations <n> a-trous filter passes (default 5)\n";
+}
 
-  const float aspectRatio = scene.camera().aspectRatio;
-  const std::uint16_t width = 600;
-  const std::uint16_t height = width / aspectRatio;
+struct SceneInput {
+  const char *file = "../scenes/07-scene-easy.gltf";
+  // Optional equirectangular PFM or HDR image lighting rays that miss.
+  const char *environment = nullptr;
+  float environmentIntensity = 1.0f;
+  // Seconds until the render is cancelled, 0 for never.
+  float cancelAfter = 0.0f;
+  // JSON render statistics, not written if null.
+  const char *statsFile = nullptr;
+  // Chrome trace_event timeline, not recorded if null.
+  const char *traceFile = nullptr;
+};
+
+bool parseArgs(int argc, char **argv, SceneInput &input,
+               RenderSettings &settings) {
+  for (int i = 1; i < argc; ++i) {
+    const char *arg = argv[i];
+    const bool hasValue = i + 1 < argc;
+
+    if (!std::strcmp(arg, "--scene") && hasValue)
+      input.file = argv[++i];
+    else if (!std::strcmp(arg, "--env") && hasValue)
+      input.environment = argv[++i];
+    else if (!std::strcmp(arg, "--env-intensity") && hasValue)
+      input.environmentIntensity = (float)std::atof(argv[++i]);
+    else if (!std::strcmp(arg, "--width") && hasValue)
+      settings.width = (std::uint16_t)std::atoi(argv[++i]);
+    else if (!std::strcmp(arg, "--spp-side") && hasValue)
+      settings.sideSampleCount = std::atoi(argv[++i]);
+    else if (!std::strcmp(arg, "--threads") && hasValue)
+      settings.threads = std::atoi(argv[++i]);
+    else if (!std::strcmp(arg, "--pin-threads"))
+      settings.pinThreads = true;
+    else if (!std::strcmp(arg, "--tile-size") && hasValue)
+      settings.tileSize = std::atoi(argv[++i]);
+    else if (!std::strcmp(arg, "--viewport") && hasValue) {
+      PixelRect &view = settings.viewport;
+      if (std::sscanf(argv[++i], "%d,%d,%d,%d", &view.x0, &view.y0, &view.x1,
+                      &view.y1) != 4) {
+        std::cerr << "--viewport expects x0,y0,x1,y1" << std::endl;
+        return false;
+      }
+    } else if (!std::strcmp(arg, "--cancel-after") && hasValue)
+      input.cancelAfter = (float)std::atof(argv[++i]);
+    else if (!std::strcmp(arg, "--stats-json") && hasValue)
+      input.statsFile = argv[++i];
+    else if (!std::strcmp(arg, "--trace") && hasValue)
+      input.traceFile = argv[++i];
+    else if (!std::strcmp(arg, "--cost-map") && hasValue) {
+      const char *metric = argv[++i];
+      if (!std::strcmp(metric, "nodes"))
+        settings.costMap = CostMap::Nodes;
+      else if (!std::strcmp(metric, "triangles"))
+        settings.costMap = CostMap::Triangles;
+      else if (!std::strcmp(metric, "path-length"))
+        settings.costMap = CostMap::PathLength;
+      else if (!std::strcmp(metric, "time"))
+        settings.costMap = CostMap::Time;
+      else {
+        std::cerr << "Unknown cost map " << metric << std::endl;
+        return false;
+      }
+    }
+    else if (!std::strcmp(arg, "--adaptive"))
+      settings.mode = RenderMode::Adaptive;
+    else if (!std::strcmp(arg, "--adaptive-threshold") && hasValue)
+      settings.adaptiveThreshold = (float)std::atof(argv[++i]);
+    else if (!std::strcmp(arg, "--adaptive-initial") && hasValue)
+      settings.adaptiveInitialSamples = std::atoi(argv[++i]);
+    else if (!std::strcmp(arg, "--adaptive-round") && hasValue)
+      settings.adaptiveRoundSamples = std::atoi(argv[++i]);
+    else if (!std::strcmp(arg, "--adaptive-max") && hasValue)
+      settings.adaptiveMaxSamples = std::atoi(argv[++i]);
+    else if (!std::strcmp(arg, "--progressive"))
+      settings.mode = RenderMode::Progressive;
+    else if (!std::strcmp(arg, "--time-budget") && hasValue)
+      settings.progressiveTimeBudget = (float)std::atof(argv[++i]);
+    else if (!std::strcmp(arg, "--noise-target") && hasValue)
+      settings.progressiveNoiseTarget = (float)std::atof(argv[++i]);
+    else if (!std::strcmp(arg, "--max-passes") && hasValue)
+      settings.progressiveMaxPasses = std::atoi(argv[++i]);
+    else if (!std::strcmp(arg, "--pass-samples") && hasValue)
+      settings.progressivePassSamples = std::atoi(argv[++i]);
+    else if (!std::strcmp(arg, "--flush-interval") && hasValue)
+      settings.progressiveFlushInterval = (float)std::atof(argv[++i]);
+    else if (!std::strcmp(arg, "--output") && hasValue)
+      settings.outputFile = argv[++i];
+    else if (!std::strcmp(arg, "--no-nee"))
+      settings.integrator.nee = false;
+    else if (!std::strcmp(arg, "--restir"))
+      settings.restir.enabled = true;
+    else if (!std::strcmp(arg, "--restir-candidates") && hasValue)
+      settings.restir.candidates = std::atoi(argv[++i]);
+    else if (!std::strcmp(arg, "--restir-spatial") && hasValue)
+      settings.restir.spatialSamples = std::atoi(argv[++i]);
+    else if (!std::strcmp(arg, "--restir-radius") && hasValue)
+      settings.restir.spatialRadius = std::atoi(argv[++i]);
+    else if (!std::strcmp(arg, "--guiding"))
+      settings.guiding.enabled = true;
+    else if (!std::strcmp(arg, "--guiding-bsdf") && hasValue)
+      settings.guiding.bsdfFraction = (float)std::atof(argv[++i]);
+    else if (!std::strcmp(arg, "--guiding-memory") && hasValue)
+      settings.guiding.maxMemoryMB = (size_t)std::atoi(argv[++i]);
+    else if (!std::strcmp(arg, "--radiance-cache"))
+      settings.radianceCache.enabled = true;
+    else if (!std::strcmp(arg, "--cache-depth") && hasValue)
+      settings.radianceCache.terminateDepth = std::atoi(argv[++i]);
+    else if (!std::strcmp(arg, "--cache-memory") && hasValue)
+      settings.radianceCache.maxMemoryMB = (size_t)std::atoi(argv[++i]);
+    else if (!std::strcmp(arg, "--wavefront"))
+      settings.wavefront = true;
+    else if (!std::strcmp(arg, "--batch-size") && hasValue)
+      settings.wavefrontBatchSize = std::atoi(argv[++i]);
+    else if (!std::strcmp(arg, "--sort-rays"))
+      settings.raySorting.enabled = true;
+    else if (!std::strcmp(arg, "--sort-batch") && hasValue)
+      settings.raySorting.batchSize = std::atoi(argv[++i]);
+    else if (!std::strcmp(arg, "--sort-bench"))
+      settings.raySorting.benchmark = true;
+    else if (!std::strcmp(arg, "--aov"))
+      settings.writeAOVs = true;
+    else if (!std::strcmp(arg, "--denoise"))
+      settings.denoise = true;
+    else if (!std::strcmp(arg, "--denoise-iterations") && hasValue)
+      settings.denoiser.iterations = std::atoi(argv[++i]);
+    else {
+      std::cerr << "Unknown option " << arg << std::endl;
+      printUsage();
+      return false;
+    }
+  }
+  if (settings.costMap != CostMap::None && settings.wavefront) {
+    std::cerr << "--cost-map needs per-pixel rendering, not --wavefront"
+              << std::endl;
+    return false;
+  }
+  return true;
+}
 
-  auto &camera = scene.camera();
-  const Vector3 camerForward = unit_vector(camera.target - camera.pos);
-  const Vector3 camerRight = unit_vector(cross(camerForward, camera.up));
-  const Vector3 camerUp = cross(camerRight, camerForward);
+// The output file name with suffix before its extension, and the extension
+// replaced if one is given: out.ppm, "_depth" gives out_depth.ppm.
+std::string siblingFile(const std::string &output, const std::string &suffix,
+                        const std::string &extension = "") {
+  const size_t slash = output.find_last_of("/\\");
+  size_t dot = output.rfind('.');
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+    dot = output.size();
+  return output.substr(0, dot) + suffix +
+         (extension.empty() ? output.substr(dot) : extension);
+}
 
-  const float pixSize = 1.0f / height;
-  // const float viewportHight = 2.0f * std::tan( (camera.fov / 180.0f * PI) *
-  // 0.5f );
-  const float viewportHight = 2.0f * std::tan((camera.fov) * 0.5f);
+// Writes the cost map false coloured to the output file and unchanged to
+// a PFM next to it. The colour scale ends at the 99th percentile, so a
+// few extreme pixels do not darken the rest.
+void saveCostMap(const Renderer &renderer, const RenderSettings &settings) {
+  static const char *const names[] = {"", "BVH nodes visited",
+                                      "triangles tested", "path segments",
+                                      "microseconds"};
+  const std::vector<float> costs = renderer.costImage();
+  std::vector<float> sorted = costs;
+  const size_t percentile = sorted.size() * 99 / 100;
+  std::nth_element(sorted.begin(), sorted.begin() + percentile, sorted.end());
+  const float scale = sorted[percentile];
+  double mean = 0.0;
+  for (float c : costs)
+    mean += c;
+  mean /= double(std::max<size_t>(costs.size(), 1));
+
+  std::cout << "Cost map: " << names[int(settings.costMap)]
+            << " per sample, mean " << mean << ", 99th percentile " << scale
+            << ", max " << *std::max_element(costs.begin(), costs.end())
+            << std::endl;
+
+  const std::string raw = siblingFile(settings.outputFile, "_cost", ".pfm");
+  saveFalseColorToFile(settings.outputFile.c_str(), renderer.width(),
+                       renderer.height(), costs, scale);
+  saveFloatImageToFile(raw.c_str(), renderer.width(), renderer.height(),
+                       costs);
+}
 
-  //	const Vector3 leftTop( -aspectRatio / 2, 0.5f, 1.0f );
-  const Vector3 leftTop(-aspectRatio * viewportHight / 2.0f,
-                        viewportHight / 2.0f, 1.0f);
+int main(int argc, char **argv) {
+  SceneInput input;
+  //input.file = "../scenes/07-scene-medium-2.gltf";
 
-  std::vector<Vector3> data;
-  data.resize(width * height);
+  RenderSettings settings;
+  if (!parseArgs(argc, argv, input, settings))
+    return 1;
 
-  // const int SIDE_SAMPLE_COUNT = scene.samples();
-  const int SIDE_SAMPLE_COUNT = 8;
-  auto start = std::chrono::high_resolution_clock::now();
+  if (input.traceFile) {
+    timeline::start();
+    timeline::setThreadName("main");
+  }
+  // Written on every exit after the render.
+  auto writeTrace = [&input]() {
+    if (input.traceFile && !timeline::write(input.traceFile))
+      std::cerr << "Cannot write " << input.traceFile << std::endl;
+  };
 
-  TaskManager manager(8, 32);
-  
-  completed_pixels = 0;
-  std::thread progress_thread(display_progress, (int)data.size());
-
-  for (int y = 0; y < height; ++y) {
-    for (int x = 0; x < width; ++x) {
-      while (!manager.add(
-          [&](int x, int y, std::vector<Vector3> &data, const Scene &scene) {
-            Vector3 color(0, 0, 0);
-            const float u = float(x) / width;
-            const float v = float(y) / height;
-
-            for (int s = 0; s < SIDE_SAMPLE_COUNT * SIDE_SAMPLE_COUNT; ++s) {
-              // Vector3 pixPos = leftTop + Vector3( pixSize / 2.0 + x *
-              // pixSize, pixSize / 2.0 + y * pixSize, 0 ); Vector3 pixPos =
-              // leftTop + Vector3( pixSize / 2.0f + u * aspectRatio, -pixSize
-              // / 2.0f - v, 0.0f );
-              const Vector3 offset = getUniformSampleOffset(s, SIDE_SAMPLE_COUNT);
-              const Vector3 pixPosVS = leftTop + Vector3((pixSize * offset.x() + u * aspectRatio) * viewportHight, (-pixSize * offset.y() - v) * viewportHight, 0.0f);
-              const Vector3 pixPos = camera.pos + pixPosVS.x() * camerRight + pixPosVS.y() * camerUp + pixPosVS.z() * camerForward;
-
-              const Vector3 dir = unit_vector(pixPos - camera.pos);
-              const math::Ray ray({camera.pos, dir});
-              // color += trace_iterative( ray, scene, 4 );
-              color += trace(ray, scene, 0);
-            }
-
-            data[y * width + x] =
-                color / float(SIDE_SAMPLE_COUNT * SIDE_SAMPLE_COUNT);
-            completed_pixels.fetch_add(1);
-          },
-          x, y, std::ref(data), std::cref(scene))) {
-        std::this_thread::yield();
-      }
-    }
+  // One pool for every phase, from loading to writing the images.
+  TaskManager pool(settings.threads, settings.maxTasks, settings.pinThreads);
+  std::cout << "Workers: " << pool.threadCount() << " threads on "
+            << pool.nodeCount() << " NUMA node(s)"
+            << (pool.pinned() ? ", pinned" : "") << std::endl;
+
+  // The environment map loads while the scene is parsed.
+  std::future<std::optional<EnvironmentMap>> environment;
+  if (input.environment)
+    environment = pool.submit([&input]() -> std::optional<EnvironmentMap> {
+      timeline::Scope scope("load environment", input.environment);
+      EnvironmentMap map;
+      if (!map.load(input.environment, input.environmentIntensity))
+        return std::nullopt;
+      return map;
+    });
+
+  Scene scene;
+  if (!gltf::parse(input.file, scene))
+    return 1;
+
+  if (environment.valid()) {
+    std::optional<EnvironmentMap> map = environment.get();
+    if (!map)
+      return 1;
+    scene.setEnvironment(std::move(*map));
   }
-  manager.stop();
+  scene.build(pool);
+  if (pool.nodeCount() > 1)
+    scene.replicate(pool);
+
+  Renderer renderer(scene, settings, pool);
+
+  auto start = std::chrono::high_resolution_clock::now();
+
+  std::thread progress_thread(display_progress, std::cref(renderer));
+
+  std::thread cancel_thread;
+  if (input.cancelAfter > 0.0f)
+    cancel_thread = std::thread([&renderer, &input, start]() {
+      const auto deadline =
+          start + std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::duration<float>(input.cancelAfter));
+      while (!renderer.finished() &&
+             std::chrono::high_resolution_clock::now() < deadline)
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+      if (!renderer.finished())
+        renderer.cancel();
+    });
+
+  renderer.render();
+
   if (progress_thread.joinable()) {
     progress_thread.join();
   }
+  if (cancel_thread.joinable()) {
+    cancel_thread.join();
+  }
   auto duration_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
       std::chrono::high_resolution_clock::now() - start);
   std::cout << "Time: " << duration_ms.count() << " milliseconds" << std::endl;
 
-  saveImageToFile(width, height, data);
-  
+  std::cout << "Scene: " << input.file << std::endl;
+  renderer.report();
+  if (input.statsFile && !renderer.writeStats(input.statsFile, input.file))
+    std::cerr << "Cannot write " << input.statsFile << std::endl;
+
+  // A cancelled render is stale: nothing is written, so earlier images in
+  // its place survive. It also stops before the AOV and denoise passes.
+  if (renderer.cancelled()) {
+    writeTrace();
+    return 0;
+  }
+
+  if (settings.costMap != CostMap::None)
+    saveCostMap(renderer, settings);
+  else
+    saveImageToFile(settings.outputFile.c_str(), renderer.width(),
+                    renderer.height(), renderer.image(), &pool);
+
+  if (settings.mode == RenderMode::Adaptive) {
+    const std::vector<float> counts = renderer.sampleCounts();
+    saveHeatmapToFile(siblingFile(settings.outputFile, "_samples").c_str(),
+                      renderer.width(), renderer.height(), counts,
+                      *std::max_element(counts.begin(), counts.end()));
+  }
+
+  if (settings.denoise) {
+    const std::string denoised = siblingFile(settings.outputFile, "_denoised");
+    saveImageToFile(denoised.c_str(), renderer.width(), renderer.height(),
+                    renderer.denoisedImage(), &pool);
+  }
+
+  if (settings.writeAOVs) {
+    const AOVBuffers &aovs = renderer.aovs();
+    std::vector<Vector3> normals(aovs.normal.size());
+    for (size_t i = 0; i < normals.size(); ++i)
+      normals[i] = aovs.normal[i] * 0.5f + Vector3(0.5f, 0.5f, 0.5f);
+
+    saveLinearImageToFile(siblingFile(settings.outputFile, "_albedo").c_str(),
+                          renderer.width(), renderer.height(), aovs.albedo);
+    saveLinearImageToFile(siblingFile(settings.outputFile, "_normal").c_str(),
+                          renderer.width(), renderer.height(), normals);
+    saveHeatmapToFile(siblingFile(settings.outputFile, "_depth").c_str(),
+                      renderer.width(), renderer.height(), aovs.depth,
+                      *std::max_element(aovs.depth.begin(), aovs.depth.end()));
+    saveHeatmapToFile(
+        siblingFile(settings.outputFile, "_variance").c_str(),
+        renderer.width(), renderer.height(), aovs.variance,
+        *std::max_element(aovs.variance.begin(), aovs.variance.end()));
+  }
+
+  writeTrace();
   return 0;
-}
\ No newline at end of file
+}
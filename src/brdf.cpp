@@ -1,37 +1,32 @@
 #include "brdf.h"
 #include "utils.h"
 
+#include <algorithm>
+
+#if PBR_BRDF_SSE
+#include <immintrin.h>
+#endif
+
 using namespace math;
 
 namespace {
 
+	constexpr int LUT_SIZE = 32;
+	constexpr int LUT_SAMPLES = 512;
+
 	float DiffuseEnergyFactor(float roughness)
 	{
 		return math::lerp(1.0f, 1.0f / 1.51f, roughness);
 	}
 
-	Vector2 FresnelComponent(Vector2 LdotH)
-	{
-		return Vector2(std::powf(1.0f - LdotH.x(), 5), std::powf(1.0f - LdotH.y(), 5));
-	}
-
 	float FresnelComponent(float LdotH)
 	{
-		return std::powf(1.0f - LdotH, 5);
+		// (1 - LdotH)^5 as a polynomial instead of powf
+		const float x = 1.0f - LdotH;
+		const float x2 = x * x;
+		return x2 * x2 * x;
 	}
 
-	Vector3 DiffuseBurley(Vector3 albedo, float roughness, float NdotV, float NdotL, float LdotH)
-	{
-		const float energyBias = math::lerp(0.f, 0.5f, roughness);
-		const float energyFactor = DiffuseEnergyFactor(roughness);
-
-		const float FD90 = energyBias + 2.0f * LdotH * LdotH * roughness;
-		const Vector2 FdVL = 1 + (FD90 - 1) * FresnelComponent(Vector2(NdotV, NdotL));
-
-		return albedo * (FdVL.x() * FdVL.y()) * energyFactor * INV_PI;
-	}
-
-
 	float NDF(float NdotH, float GGXalpha)
 	{
 		// GGX / Trowbridge-Reitz
@@ -54,31 +49,357 @@ namespace {
 		return 0.5f / std::max(EPS, lambdaV + lambdaL);
 	}
 
-	Vector3 FresnelSchlick(Vector3 specColor, float LdotH)
+	void BuildBasis(const Vector3& N, Vector3& T, Vector3& B)
 	{
-		// [Schlick 1994, "An Inexpensive BRDF Model for Physically-Based Rendering"]
-		// values less 0.02 is incorrect and pretend to be specular occlusion
-		return (specColor + (saturate(50.0f * specColor.y()) - specColor) * FresnelComponent(LdotH));
+		// [Duff et al. 2017, "Building an Orthonormal Basis, Revisited"]
+		const float sign = std::copysign(1.0f, N.z());
+		const float a = -1.0f / (sign + N.z());
+		const float b = N.x() * N.y() * a;
+		T = Vector3(1.0f + sign * N.x() * N.x() * a, sign * b, -sign * N.x());
+		B = Vector3(b, sign + N.y() * N.y() * a, -N.y());
+	}
+
+	Vector3 SampleGGX(const Vector3& N, float GGXalpha, float u0, float u1)
+	{
+		const float a2 = GGXalpha * GGXalpha;
+		const float cosTheta = std::sqrt((1.0f - u0) / (1.0f + (a2 - 1.0f) * u0));
+		const float sinTheta = std::sqrt(std::max(0.0f, 1.0f - cosTheta * cosTheta));
+		const float phi = 2.0f * PI * u1;
+
+		Vector3 T, B;
+		BuildBasis(N, T, B);
+		return unit_vector(T * (sinTheta * std::cos(phi)) + B * (sinTheta * std::sin(phi)) + N * cosTheta);
+	}
+
+	Vector3 SampleCosine(const Vector3& N, float u0, float u1)
+	{
+		const float r = std::sqrt(u0);
+		const float phi = 2.0f * PI * u1;
+
+		Vector3 T, B;
+		BuildBasis(N, T, B);
+		return unit_vector(T * (r * std::cos(phi)) + B * (r * std::sin(phi)) + N * std::sqrt(std::max(0.0f, 1.0f - u0)));
+	}
+
+	// Directional albedo E(NdotV, roughness) of the single scattering GGX
+	// lobe with F = 1 and its cosine weighted average Eavg(roughness), for
+	// multiple scattering compensation.
+	// [Kulla and Conty 2017, "Revisiting Physically Based Shading at Imageworks"]
+	class EnergyTables
+	{
+	public:
+		EnergyTables()
+		{
+			for (int r = 0; r < LUT_SIZE; ++r)
+			{
+				const float roughness = std::max(float(r) / (LUT_SIZE - 1), 0.005f);
+				const float GGXalpha = roughness * roughness;
+
+				float average = 0.0f;
+				for (int m = 0; m < LUT_SIZE; ++m)
+				{
+					const float NdotV = std::max(float(m) / (LUT_SIZE - 1), 1e-3f);
+					E_[r][m] = std::min(1.0f, integrate(NdotV, GGXalpha));
+					average += E_[r][m] * NdotV;
+				}
+				Eavg_[r] = std::min(1.0f, 2.0f * average / LUT_SIZE);
+			}
+		}
+
+		float E(float NdotV, float roughness) const
+		{
+			const float fr = saturate(roughness) * (LUT_SIZE - 1);
+			const float fm = saturate(NdotV) * (LUT_SIZE - 1);
+			const int r0 = std::min(int(fr), LUT_SIZE - 2);
+			const int m0 = std::min(int(fm), LUT_SIZE - 2);
+			const float tr = fr - r0;
+			const float tm = fm - m0;
+
+			return lerp(lerp(E_[r0][m0], E_[r0][m0 + 1], tm), lerp(E_[r0 + 1][m0], E_[r0 + 1][m0 + 1], tm), tr);
+		}
+
+		float Eavg(float roughness) const
+		{
+			const float fr = saturate(roughness) * (LUT_SIZE - 1);
+			const int r0 = std::min(int(fr), LUT_SIZE - 2);
+			return lerp(Eavg_[r0], Eavg_[r0 + 1], fr - r0);
+		}
+
+	private:
+		static float integrate(float NdotV, float GGXalpha)
+		{
+			const Vector3 N(0.0f, 0.0f, 1.0f);
+			const Vector3 V(std::sqrt(1.0f - NdotV * NdotV), 0.0f, NdotV);
+			const int side = 16;
+
+			// Stratified GGX importance sampling, D cancels out of f * cos / pdf.
+			float sum = 0.0f;
+			for (int i = 0; i < LUT_SAMPLES; ++i)
+			{
+				const float u0 = (float(i % side) + 0.5f) / side;
+				const float u1 = (float(i / side) + 0.5f) / (LUT_SAMPLES / side);
+				const Vector3 H = SampleGGX(N, GGXalpha, u0, u1);
+				const float VdotH = dot(V, H);
+				const Vector3 L = 2.0f * VdotH * H - V;
+				const float NdotL = dot(N, L);
+				if (NdotL <= 0.0f || VdotH <= 0.0f)
+					continue;
+
+				sum += 4.0f * VF(NdotL, NdotV, GGXalpha) * NdotL * VdotH / std::max(EPS, H.z());
+			}
+			return sum / LUT_SAMPLES;
+		}
+
+		float E_[LUT_SIZE][LUT_SIZE];
+		float Eavg_[LUT_SIZE];
+	};
+
+	const EnergyTables& energyTables()
+	{
+		static const EnergyTables tables;
+		return tables;
+	}
+
+	// Probability of sampling the specular lobe: its share of the directional
+	// albedo, taken from the same tables as the compensation.
+	float SpecularProbability(const ShadingRecord& s, float NdotV)
+	{
+		const float E = energyTables().E(NdotV, s.roughness);
+		const Vector3 Fss = s.specColor + (s.fresnel90 - s.specColor) * FresnelComponent(NdotV);
+
+		const float specular = luminance(Fss) * E + s.specularAverage * (1.0f - E);
+		if (specular + s.diffuseAverage <= 0.0f)
+			return 0.5f;
+		return std::clamp(specular / (specular + s.diffuseAverage), 0.05f, 0.95f);
+	}
+
+	float MultipleScatteringFactor(const ShadingRecord& s, float NdotV, float NdotL)
+	{
+		const EnergyTables& tables = energyTables();
+		return (1.0f - tables.E(NdotV, s.roughness)) * (1.0f - tables.E(NdotL, s.roughness)) * s.multiScatterScale;
+	}
+
+#if PBR_BRDF_SSE
+	// Four lanes of BRDF * NdotL, mirroring the scalar BRDF() term by term.
+	void EvalBRDF4(const ShadingRecord* records, BRDFBatch& batch, size_t i)
+	{
+		const ShadingRecord* s[4];
+		for (int k = 0; k < 4; ++k)
+			s[k] = &records[batch.record[i + k]];
+
+		const auto lane = [&](auto field) {
+			return _mm_setr_ps(field(*s[0]), field(*s[1]), field(*s[2]), field(*s[3]));
+		};
+		const auto dot3 = [](__m128 ax, __m128 ay, __m128 az, __m128 bx, __m128 by, __m128 bz) {
+			return _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax, bx), _mm_mul_ps(ay, by)), _mm_mul_ps(az, bz));
+		};
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 one = _mm_set1_ps(1.0f);
+		const auto saturate4 = [&](__m128 x) { return _mm_max_ps(zero, _mm_min_ps(x, one)); };
+		const auto pow5 = [&](__m128 x) {
+			const __m128 y = _mm_sub_ps(one, x);
+			const __m128 y2 = _mm_mul_ps(y, y);
+			return _mm_mul_ps(_mm_mul_ps(y2, y2), y);
+		};
+
+		const __m128 lx = _mm_loadu_ps(&batch.lx[i]), ly = _mm_loadu_ps(&batch.ly[i]), lz = _mm_loadu_ps(&batch.lz[i]);
+		const __m128 vx = _mm_loadu_ps(&batch.vx[i]), vy = _mm_loadu_ps(&batch.vy[i]), vz = _mm_loadu_ps(&batch.vz[i]);
+		const __m128 nx = _mm_loadu_ps(&batch.nx[i]), ny = _mm_loadu_ps(&batch.ny[i]), nz = _mm_loadu_ps(&batch.nz[i]);
+
+		__m128 hx = _mm_add_ps(lx, vx), hy = _mm_add_ps(ly, vy), hz = _mm_add_ps(lz, vz);
+		const __m128 invLength = _mm_div_ps(one, _mm_sqrt_ps(_mm_max_ps(dot3(hx, hy, hz, hx, hy, hz), _mm_set1_ps(EPS))));
+		hx = _mm_mul_ps(hx, invLength);
+		hy = _mm_mul_ps(hy, invLength);
+		hz = _mm_mul_ps(hz, invLength);
+
+		const __m128 cosTheta = dot3(nx, ny, nz, lx, ly, lz);
+		const __m128 NdotL = saturate4(cosTheta);
+		const __m128 absNdotV = _mm_andnot_ps(_mm_set1_ps(-0.0f), dot3(nx, ny, nz, vx, vy, vz));
+		const __m128 NdotV = saturate4(_mm_add_ps(absNdotV, _mm_set1_ps(1e-5f)));
+		const __m128 NdotH = saturate4(dot3(nx, ny, nz, hx, hy, hz));
+		const __m128 LdotH = saturate4(dot3(lx, ly, lz, hx, hy, hz));
+
+		// Diffuse (Burley)
+		const __m128 roughness = lane([](const ShadingRecord& r) { return r.roughness; });
+		const __m128 FD90 = _mm_add_ps(lane([](const ShadingRecord& r) { return r.energyBias; }),
+			_mm_mul_ps(_mm_mul_ps(_mm_set1_ps(2.0f), _mm_mul_ps(LdotH, LdotH)), roughness));
+		const __m128 FD90m1 = _mm_sub_ps(FD90, one);
+		const __m128 Fd = _mm_mul_ps(_mm_add_ps(one, _mm_mul_ps(FD90m1, pow5(NdotV))), _mm_add_ps(one, _mm_mul_ps(FD90m1, pow5(NdotL))));
+
+		// Specular D * Vis
+		const __m128 alpha = lane([](const ShadingRecord& r) { return r.alpha; });
+		const __m128 alpha2 = _mm_mul_ps(alpha, alpha);
+		const __m128 denominator = _mm_add_ps(_mm_mul_ps(_mm_sub_ps(alpha2, one), _mm_mul_ps(NdotH, NdotH)), one);
+		const __m128 d = _mm_div_ps(alpha, _mm_max_ps(_mm_set1_ps(EPS), denominator));
+		const __m128 D = _mm_mul_ps(_mm_mul_ps(d, d), _mm_set1_ps(INV_PI));
+		const __m128 invAlpha = _mm_sub_ps(one, alpha);
+		const __m128 lambdaV = _mm_mul_ps(NdotL, _mm_add_ps(_mm_mul_ps(NdotV, invAlpha), alpha));
+		const __m128 lambdaL = _mm_mul_ps(NdotV, _mm_add_ps(_mm_mul_ps(NdotL, invAlpha), alpha));
+		const __m128 Vis = _mm_div_ps(_mm_set1_ps(0.5f), _mm_max_ps(_mm_set1_ps(EPS), _mm_add_ps(lambdaV, lambdaL)));
+		const __m128 DVis = _mm_mul_ps(D, Vis);
+		const __m128 Fc = pow5(LdotH);
+		const __m128 f90 = lane([](const ShadingRecord& r) { return r.fresnel90; });
+
+		// Multiple scattering reads the energy tables lane by lane.
+		alignas(16) float nv[4], nl[4], ms[4];
+		_mm_store_ps(nv, NdotV);
+		_mm_store_ps(nl, NdotL);
+		for (int k = 0; k < 4; ++k)
+			ms[k] = MultipleScatteringFactor(*s[k], nv[k], nl[k]);
+		const __m128 msFactor = _mm_load_ps(ms);
+
+		// Directions below the surface contribute nothing.
+		const __m128 weight = _mm_and_ps(_mm_cmpgt_ps(cosTheta, zero), cosTheta);
+
+		const auto channel = [&](auto spec, auto diffuse, auto tint, float* out) {
+			const __m128 F0 = lane(spec);
+			const __m128 F = _mm_add_ps(F0, _mm_mul_ps(_mm_sub_ps(f90, F0), Fc));
+			__m128 f = _mm_mul_ps(lane(diffuse), Fd);
+			f = _mm_add_ps(f, _mm_mul_ps(DVis, F));
+			f = _mm_add_ps(f, _mm_mul_ps(lane(tint), msFactor));
+			_mm_storeu_ps(out, _mm_mul_ps(f, weight));
+		};
+		channel([](const ShadingRecord& r) { return r.specColor.x(); }, [](const ShadingRecord& r) { return r.diffuseColor.x(); },
+			[](const ShadingRecord& r) { return r.multiScatterTint.x(); }, &batch.r[i]);
+		channel([](const ShadingRecord& r) { return r.specColor.y(); }, [](const ShadingRecord& r) { return r.diffuseColor.y(); },
+			[](const ShadingRecord& r) { return r.multiScatterTint.y(); }, &batch.g[i]);
+		channel([](const ShadingRecord& r) { return r.specColor.z(); }, [](const ShadingRecord& r) { return r.diffuseColor.z(); },
+			[](const ShadingRecord& r) { return r.multiScatterTint.z(); }, &batch.b[i]);
 	}
+#endif
 }
 
-Vector3 BRDF(const Vector3& inputAlbedo, float metallic, float roughness, const Vector3& L, const Vector3& H, const Vector3& N, const Vector3& V)
+ShadingRecord makeShadingRecord(const Vector3& inputAlbedo, float metallic, float roughness)
 {
-	auto specColor = math::lerp(Vector3(0.04f, 0.04f, 0.04f), inputAlbedo, metallic);
-	auto albedo = math::lerp(inputAlbedo, Vector3(), metallic);
-	const float NdotL = math::saturate(dot(N, L));
+	ShadingRecord s;
+	s.roughness = std::max(roughness, 0.005f);
+	s.alpha = s.roughness * s.roughness;
+	s.specColor = math::lerp(Vector3(0.04f, 0.04f, 0.04f), inputAlbedo, metallic);
+	// values less 0.02 is incorrect and pretend to be specular occlusion
+	s.fresnel90 = saturate(50.0f * s.specColor.y());
+
+	const float energyFactor = DiffuseEnergyFactor(s.roughness);
+	const Vector3 albedo = math::lerp(inputAlbedo, Vector3(), metallic);
+	s.diffuseColor = albedo * energyFactor * INV_PI;
+	s.energyBias = math::lerp(0.f, 0.5f, s.roughness);
+
+	// Schlick average Fresnel between F0 and fresnel90, and the resulting
+	// multiple scattering tint; zero when the Fresnel term is zero throughout.
+	const EnergyTables& tables = energyTables();
+	const float Eavg = tables.Eavg(s.roughness);
+	const Vector3 Favg = s.specColor + (s.fresnel90 - s.specColor) * (1.0f / 21.0f);
+	const Vector3 one(1.0f, 1.0f, 1.0f);
+	s.multiScatterTint = Favg * Favg * Eavg / (one - Favg * (1.0f - Eavg));
+	s.multiScatterScale = Eavg < 1.0f ? 1.0f / (PI * (1.0f - Eavg)) : 0.0f;
 
-	roughness = std::max(roughness, 0.005f);
+	s.specularAverage = luminance(Favg);
+	s.diffuseAverage = luminance(albedo) * energyFactor;
+	return s;
+}
+
+Vector3 BRDF(const ShadingRecord& s, const Vector3& L, const Vector3& H, const Vector3& N, const Vector3& V)
+{
+	const float NdotL = math::saturate(dot(N, L));
 
 	// Avoid division by 0 in GGX formula in case NdotV == 0
 	const float  NdotV = saturate(std::abs(dot(N, V)) + 1e-5f);
 	const float NdotH = saturate(dot(N, H));
 	const float LdotH = saturate(dot(L, H));
 
-	const float GGXalpha = roughness * roughness;
+	// [Burley 2012, "Physically-Based Shading at Disney"]
+	const float FD90 = s.energyBias + 2.0f * LdotH * LdotH * s.roughness;
+	const float FdV = 1 + (FD90 - 1) * FresnelComponent(NdotV);
+	const float FdL = 1 + (FD90 - 1) * FresnelComponent(NdotL);
+	const Vector3 diffuse = s.diffuseColor * (FdV * FdL);
+
+	// [Schlick 1994, "An Inexpensive BRDF Model for Physically-Based Rendering"]
+	const Vector3 F = s.specColor + (s.fresnel90 - s.specColor) * FresnelComponent(LdotH);
+	const Vector3 specular = NDF(NdotH, s.alpha) * VF(NdotL, NdotV, s.alpha) * F;
+	const Vector3 multiScatter = s.multiScatterTint * MultipleScatteringFactor(s, NdotV, NdotL);
+
+	return diffuse + specular + multiScatter;
+}
+
+Vector3 BRDF(const Vector3& inputAlbedo, float metallic, float roughness, const Vector3& L, const Vector3& H, const Vector3& N, const Vector3& V)
+{
+	return BRDF(makeShadingRecord(inputAlbedo, metallic, roughness), L, H, N, V);
+}
+
+void BRDFBatch::clear()
+{
+	for (auto* v : { &lx, &ly, &lz, &vx, &vy, &vz, &nx, &ny, &nz })
+		v->clear();
+	record.clear();
+}
+
+void BRDFBatch::push(const Vector3& L, const Vector3& V, const Vector3& N, std::uint32_t material)
+{
+	lx.push_back(L.x()); ly.push_back(L.y()); lz.push_back(L.z());
+	vx.push_back(V.x()); vy.push_back(V.y()); vz.push_back(V.z());
+	nx.push_back(N.x()); ny.push_back(N.y()); nz.push_back(N.z());
+	record.push_back(material);
+}
+
+void evalBRDF(const ShadingRecord* records, BRDFBatch& batch)
+{
+	const size_t count = batch.size();
+	batch.r.resize(count);
+	batch.g.resize(count);
+	batch.b.resize(count);
+
+	size_t i = 0;
+#if PBR_BRDF_SSE
+	for (; i + 4 <= count; i += 4)
+		EvalBRDF4(records, batch, i);
+#endif
+	for (; i < count; ++i)
+	{
+		const Vector3 L(batch.lx[i], batch.ly[i], batch.lz[i]);
+		const Vector3 V(batch.vx[i], batch.vy[i], batch.vz[i]);
+		const Vector3 N(batch.nx[i], batch.ny[i], batch.nz[i]);
+		const float cosTheta = dot(N, L);
+
+		Vector3 f;
+		if (cosTheta > 0.0f)
+			f = BRDF(records[batch.record[i]], L, unit_vector(L + V), N, V) * cosTheta;
+		batch.r[i] = f.x();
+		batch.g[i] = f.y();
+		batch.b[i] = f.z();
+	}
+}
+
+void initBRDFTables()
+{
+	energyTables();
+}
+
+Vector3 sampleBRDF(const ShadingRecord& s, const Vector3& N, const Vector3& V, float u0, float u1, float u2)
+{
+	const float NdotV = saturate(std::abs(dot(N, V)) + 1e-5f);
+
+	if (u0 < SpecularProbability(s, NdotV))
+	{
+		const Vector3 H = SampleGGX(N, s.alpha, u1, u2);
+		return 2.0f * dot(V, H) * H - V;
+	}
+	return SampleCosine(N, u1, u2);
+}
+
+float pdfBRDF(const ShadingRecord& s, const Vector3& N, const Vector3& V, const Vector3& L)
+{
+	const float NdotL = dot(N, L);
+	if (NdotL <= 0.0f)
+		return 0.0f;
+
+	const float NdotV = saturate(std::abs(dot(N, V)) + 1e-5f);
+	const float specularProbability = SpecularProbability(s, NdotV);
+
+	const Vector3 H = unit_vector(L + V);
+	const float NdotH = saturate(dot(N, H));
+	const float VdotH = std::max(EPS, dot(V, H));
 
-	const Vector3 diffuse = DiffuseBurley(albedo, roughness, NdotV, NdotL, LdotH);
-	const Vector3 specular = NDF(NdotH, GGXalpha) * VF(NdotL, NdotV, GGXalpha) * FresnelSchlick(specColor, LdotH);
+	const float pdfSpecular = NDF(NdotH, s.alpha) * NdotH / (4.0f * VdotH);
+	const float pdfDiffuse = NdotL * INV_PI;
 
-	return diffuse + specular;
+	return specularProbability * pdfSpecular + (1.0f - specularProbability) * pdfDiffuse;
 }
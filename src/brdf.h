@@ -2,4 +2,62 @@
 
 #include "vector.h"
 
-Vector3 BRDF(const Vector3& inputAlbedo, float metallic, float roughness, const Vector3& L, const Vector3& H, const Vector3& N, const Vector3& V);
\ No newline at end of file
+#include <cstdint>
+#include <vector>
+
+#if !defined(PBR_BRDF_SSE)
+#if defined(__SSE2__) || defined(_M_X64)
+#define PBR_BRDF_SSE 1
+#else
+#define PBR_BRDF_SSE 0
+#endif
+#endif
+
+// Material constants of the BRDF, derived once per material instead of on
+// every evaluation. Exactly one cache line.
+struct alignas(64) ShadingRecord {
+  Vector3 specColor;
+  Vector3 diffuseColor; // albedo * energy factor / PI
+  Vector3 multiScatterTint;
+  float fresnel90;
+  float roughness;
+  float alpha;
+  float energyBias;
+  float multiScatterScale;
+  // Luminance of the average specular Fresnel and of the diffuse albedo,
+  // for lobe selection.
+  float specularAverage;
+  float diffuseAverage;
+};
+
+ShadingRecord makeShadingRecord(const Vector3& inputAlbedo, float metallic, float roughness);
+
+Vector3 BRDF(const ShadingRecord& s, const Vector3& L, const Vector3& H, const Vector3& N, const Vector3& V);
+Vector3 BRDF(const Vector3& inputAlbedo, float metallic, float roughness, const Vector3& L, const Vector3& H, const Vector3& N, const Vector3& V);
+
+// Directions, normals and shading record indices in structure-of-arrays
+// form. evalBRDF fills r, g and b with BRDF * NdotL.
+struct BRDFBatch {
+  std::vector<float> lx, ly, lz;
+  std::vector<float> vx, vy, vz;
+  std::vector<float> nx, ny, nz;
+  std::vector<std::uint32_t> record;
+  std::vector<float> r, g, b;
+
+  size_t size() const { return record.size(); }
+  void clear();
+  void push(const Vector3& L, const Vector3& V, const Vector3& N, std::uint32_t material);
+};
+
+// Four directions at a time with SSE where available.
+void evalBRDF(const ShadingRecord* records, BRDFBatch& batch);
+
+// Builds the GGX energy compensation tables; otherwise the first BRDF call
+// does it.
+void initBRDFTables();
+
+// Picks the diffuse or the specular lobe in proportion to their directional
+// albedo and samples a direction from it. pdfBRDF is the density of the
+// whole mixture.
+Vector3 sampleBRDF(const ShadingRecord& s, const Vector3& N, const Vector3& V, float u0, float u1, float u2);
+float pdfBRDF(const ShadingRecord& s, const Vector3& N, const Vector3& V, const Vector3& L);
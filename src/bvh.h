@@ -1,16 +1,37 @@
 #pragma once
 
 #include <algorithm>
+#include <cstdint>
 #include <iostream>
 #include <memory>
 #include <vector>
 
+#include "concurrency.h"
+#include "instrument.h"
 #include "utils.h"
 #include "vector.h"
 
+// Work of one traversal, summed over nodes by the caller.
+struct TraversalStats {
+  std::uint32_t nodes = 0;
+  std::uint32_t triangles = 0;
+  PBR_INSTRUMENT_ONLY(std::uint32_t boxHits = 0;)
+};
+
 template <typename T> class BVH {
 public:
-  void build(const std::vector<T> &shapes) {
+  BVH() = default;
+  // Copies are deep, for replicas in the memory of another NUMA node.
+  BVH(const BVH &other) : root_(other.root_ ? copy(*other.root_) : nullptr) {}
+  BVH &operator=(const BVH &other) {
+    root_ = other.root_ ? copy(*other.root_) : nullptr;
+    return *this;
+  }
+  BVH(BVH &&) = default;
+  BVH &operator=(BVH &&) = default;
+
+  // With a pool, large subtrees are split in parallel.
+  void build(const std::vector<T> &shapes, TaskManager *pool = nullptr) {
     root_ = std::make_unique<Node>();
 
     for (const auto &t : shapes) {
@@ -19,11 +40,19 @@ public:
 
     root_->shapes = shapes;
 
-    split(*root_.get());
+    split(*root_.get(), 0, pool);
+  }
+
+  // Nodes visited and shapes tested are added to stats.
+  float intersect(const math::Ray &ray, float tMin, float tMax, T &tr,
+                  TraversalStats &stats) const {
+    return intersect(ray, *root_.get(), tMin, tMax, tr, stats);
   }
 
-  float intersect(const math::Ray &ray, float tMin, float tMax, T &tr) const {
-    return intersect(ray, *root_.get(), tMin, tMax, tr);
+  // Any hit in (tMin, tMax), stops at the first one found.
+  bool occluded(const math::Ray &ray, float tMin, float tMax,
+                TraversalStats &stats) const {
+    return occluded(ray, *root_.get(), tMin, tMax, stats);
   }
 
   void print() const {
@@ -52,7 +81,21 @@ private:
     std::unique_ptr<Node> childB;
   };
 
-  void split(Node &parent, int depth = 0) const {
+  static std::unique_ptr<Node> copy(const Node &node) {
+    auto result = std::make_unique<Node>();
+    result->box = node.box;
+    result->shapes = node.shapes;
+    if (node.childA)
+      result->childA = copy(*node.childA);
+    if (node.childB)
+      result->childB = copy(*node.childB);
+    return result;
+  }
+
+  // Nodes with fewer shapes are not worth a task.
+  static constexpr size_t PARALLEL_SPLIT_SIZE = 4096;
+
+  void split(Node &parent, int depth = 0, TaskManager *pool = nullptr) const {
     if (depth > 10)
       return;
     if (parent.shapes.size() <= 2)
@@ -89,8 +132,16 @@ private:
 
     parent.shapes = {};
 
-    split(*parent.childA, depth + 1);
-    split(*parent.childB, depth + 1);
+    if (pool && parent.childA->shapes.size() >= PARALLEL_SPLIT_SIZE) {
+      TaskGroup group(*pool);
+      group.run([&]() { split(*parent.childA, depth + 1, pool); });
+      split(*parent.childB, depth + 1, pool);
+      group.wait();
+      return;
+    }
+
+    split(*parent.childA, depth + 1, pool);
+    split(*parent.childB, depth + 1, pool);
   }
 
   void printNode(const Node &node, int depth, int &emptyCount,
@@ -130,10 +181,12 @@ private:
   }
 
   float intersect(const math::Ray &ray, const Node &node, float tMin,
-                  float tMax, T &tr) const {
+                  float tMax, T &tr, TraversalStats &stats) const {
+    ++stats.nodes;
     float tBox;
     if (!intersectBB(ray, node.box, tMin, tMax, tBox))
       return tMax;
+    PBR_INSTRUMENT_ONLY(++stats.boxHits;)
 
     if (node.shapes.empty()) {
       // Internal Node (or empty leaf)
@@ -146,12 +199,12 @@ private:
 
       float tHitA = tMax;
       if (node.childA)
-        tHitA = intersect(ray, *node.childA, tMin, tMax, trA);
+        tHitA = intersect(ray, *node.childA, tMin, tMax, trA, stats);
 
       float searchMaxB = std::min(tMax, tHitA);
       float tHitB = tMax;
       if (node.childB)
-        tHitB = intersect(ray, *node.childB, tMin, searchMaxB, trB);
+        tHitB = intersect(ray, *node.childB, tMin, searchMaxB, trB, stats);
 
       if (tHitB < tHitA) {
         tr = trB;
@@ -162,6 +215,7 @@ private:
       }
     } else {
       // Leaf Node with shapes
+      stats.triangles += std::uint32_t(node.shapes.size());
       float closestT = tMax;
       for (const auto &triangle : node.shapes) {
         float t = math::intersect(ray, triangle, tMin, closestT);
@@ -174,5 +228,26 @@ private:
     }
   }
 
+  bool occluded(const math::Ray &ray, const Node &node, float tMin,
+                float tMax, TraversalStats &stats) const {
+    ++stats.nodes;
+    float tBox;
+    if (!intersectBB(ray, node.box, tMin, tMax, tBox))
+      return false;
+    PBR_INSTRUMENT_ONLY(++stats.boxHits;)
+
+    if (node.shapes.empty()) {
+      return (node.childA && occluded(ray, *node.childA, tMin, tMax, stats)) ||
+             (node.childB && occluded(ray, *node.childB, tMin, tMax, stats));
+    }
+
+    for (const auto &shape : node.shapes) {
+      ++stats.triangles;
+      if (math::intersect(ray, shape, tMin, tMax) < tMax)
+        return true;
+    }
+    return false;
+  }
+
   std::unique_ptr<Node> root_;
 };
@@ -1,48 +1,480 @@
 #include "concurrency.h"
+#include "timeline.h"
 
-TaskManager::TaskManager(int numThreads, int maxTasks) : maxTasks_(maxTasks)
+#include <chrono>
+#include <mutex>
+
+static_assert(sizeof(Task) <= Task::HEADER_SIZE, "task header does not fit");
+
+namespace
 {
-    isRunning_ = true;
+    constexpr std::align_val_t BLOCK_ALIGNMENT{ 64 };
+    // Blocks per slab in the smallest class; larger classes get as many as
+    // fit the same number of bytes, but at least four.
+    constexpr size_t SLAB_BLOCKS = 256;
+
+    std::atomic<long long> heapAllocationCount{ 0 };
+
+    // Pools of exited threads, waiting for a new thread. Only touched when
+    // a thread allocates its first task or exits.
+    std::mutex orphanMutex;
+    std::vector<TaskPool*>& orphanPools()
+    {
+        static std::vector<TaskPool*> pools;
+        return pools;
+    }
+
+    struct LocalPool
+    {
+        TaskPool* pool = nullptr;
+
+        ~LocalPool()
+        {
+            if (!pool)
+                return;
+            std::lock_guard<std::mutex> lock(orphanMutex);
+            orphanPools().push_back(pool);
+        }
+    };
+
+    thread_local LocalPool localPool;
+
+    int sizeClass(size_t bytes)
+    {
+        int c = 0;
+        while (c < TaskPool::CLASS_COUNT && (size_t(64) << c) < bytes)
+            ++c;
+        return c;
+    }
+
+    // Pool and worker index of the calling thread, if it is a worker.
+    struct WorkerContext
+    {
+        const TaskManager* pool = nullptr;
+        int index = -1;
+        int node = 0;
+        TaskPriority priority = TaskPriority::Normal;
+    };
+
+    thread_local WorkerContext currentWorker;
+
+    // Add for counters with a single writer, no locked instruction.
+    template <typename T>
+    void bump(std::atomic<T>& counter, T amount)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+    std::uint32_t xorshift(std::uint32_t& state)
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    }
+}
+
+Task* Task::allocate(size_t bytes)
+{
+    return TaskPool::local().allocate(bytes);
+}
+
+void Task::run()
+{
+    invoke_(this);
+    TaskPool::release(this);
+}
+
+long long TaskPool::heapAllocations()
+{
+    return heapAllocationCount.load(std::memory_order_relaxed);
+}
+
+TaskPool& TaskPool::local()
+{
+    if (!localPool.pool)
+    {
+        std::lock_guard<std::mutex> lock(orphanMutex);
+        std::vector<TaskPool*>& orphans = orphanPools();
+        if (orphans.empty())
+        {
+            localPool.pool = new TaskPool();
+        }
+        else
+        {
+            localPool.pool = orphans.back();
+            orphans.pop_back();
+        }
+    }
+    return *localPool.pool;
+}
+
+Task* TaskPool::allocate(size_t bytes)
+{
+    const int c = sizeClass(bytes);
+    if (c == CLASS_COUNT)
+    {
+        // Closures this large are not expected on hot paths.
+        heapAllocationCount.fetch_add(1, std::memory_order_relaxed);
+        Task* task = static_cast<Task*>(::operator new(bytes, BLOCK_ALIGNMENT));
+        task->owner_ = nullptr;
+        task->sizeClass_ = CLASS_COUNT;
+        return task;
+    }
+
+    if (!free_[c])
+        free_[c] = remote_[c].exchange(nullptr, std::memory_order_acquire);
+
+    if (!free_[c])
+    {
+        const size_t blockSize = size_t(64) << c;
+        const size_t count = std::max<size_t>(4, SLAB_BLOCKS >> c);
+        char* slab = static_cast<char*>(::operator new(blockSize * count, BLOCK_ALIGNMENT));
+        slabs_.push_back(slab);
+        heapAllocationCount.fetch_add(1, std::memory_order_relaxed);
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            Task* block = reinterpret_cast<Task*>(slab + i * blockSize);
+            block->owner_ = this;
+            block->sizeClass_ = std::uint32_t(c);
+            block->next_ = free_[c];
+            free_[c] = block;
+        }
+    }
+
+    Task* task = free_[c];
+    free_[c] = task->next_;
+    return task;
+}
+
+void TaskPool::release(Task* task)
+{
+    TaskPool* owner = task->owner_;
+    if (!owner)
+    {
+        ::operator delete(task, BLOCK_ALIGNMENT);
+        return;
+    }
+
+    const int c = int(task->sizeClass_);
+    if (owner == localPool.pool)
+    {
+        task->next_ = owner->free_[c];
+        owner->free_[c] = task;
+        return;
+    }
+
+    // Many threads push, only the owner takes, and it takes everything, so
+    // there is no ABA problem.
+    Task* head = owner->remote_[c].load(std::memory_order_relaxed);
+    do
+        task->next_ = head;
+    while (!owner->remote_[c].compare_exchange_weak(head, task, std::memory_order_release, std::memory_order_relaxed));
+}
+
+TaskManager::TaskManager(int numThreads, int maxTasks, bool pinWorkers)
+    : pinned_(pinWorkers), maxTasks_(std::max(1, maxTasks))
+{
+    // At most maxTasks_ tasks are queued over all levels together.
+    for (auto& queue : injected_)
+        queue = std::make_unique<BoundedQueue<Task>>(size_t(maxTasks_));
+
+    const CpuTopology topology = CpuTopology::detect();
+    if (numThreads <= 0)
+        numThreads = topology.cpuCount();
+
+    // CPUs taken round robin over the nodes, so any thread count spreads
+    // evenly; node slots are only made for nodes that get a worker.
+    std::vector<std::pair<int, int>> order;
+    for (size_t k = 0; order.size() < size_t(topology.cpuCount()); ++k)
+    {
+        for (size_t n = 0; n < topology.nodes.size(); ++n)
+        {
+            if (k < topology.nodes[n].cpus.size())
+                order.push_back({ int(n), topology.nodes[n].cpus[k] });
+        }
+    }
+
+    std::vector<int> slot(topology.nodes.size(), -1);
+    for (int i = 0; i < numThreads; ++i)
+    {
+        const auto [node, cpu] = order[size_t(i) % order.size()];
+        if (slot[node] < 0)
+        {
+            slot[node] = int(nodeCpus_.size());
+            nodeCpus_.push_back(topology.nodes[node].cpus);
+        }
+
+        workers_.push_back(std::make_unique<Worker>());
+        Worker& worker = *workers_.back();
+        worker.rng = 0x9e3779b9u * std::uint32_t(i + 1);
+        worker.node = slot[node];
+        worker.cpu = cpu;
+    }
+
     for (int i = 0; i < numThreads; ++i)
     {
-        threads_.push_back(std::thread([this]() {
-            while (true)
+        for (int j = 0; j < numThreads; ++j)
+        {
+            if (j != i)
+                (workers_[j]->node == workers_[i]->node ? workers_[i]->nearVictims : workers_[i]->farVictims).push_back(j);
+        }
+    }
+
+    for (int i = 0; i < numThreads; ++i)
+        threads_.emplace_back([this, i]() { workerLoop(i); });
+}
+
+int TaskManager::currentNode()
+{
+    return currentWorker.node;
+}
+
+TaskPriority TaskManager::currentPriority()
+{
+    return currentWorker.priority;
+}
+
+std::vector<TaskManager::WorkerStats> TaskManager::workerStats() const
+{
+    std::vector<WorkerStats> stats;
+    for (const auto& worker : workers_)
+    {
+        stats.push_back({ worker->node, worker->cpu, worker->tasks.load(std::memory_order_relaxed), worker->steals.load(std::memory_order_relaxed),
+            double(worker->busyNs.load(std::memory_order_relaxed)) * 1e-9 });
+    }
+    return stats;
+}
+
+TaskManager::~TaskManager()
+{
+    stop();
+}
+
+size_t TaskManager::reserve(size_t count, bool block)
+{
+    pending_.fetch_add(std::int64_t(count));
+    if (currentWorker.pool == this)
+        return count;
+
+    while (true)
+    {
+        // Counted before the running check, so stop() either sees the
+        // tasks pending or this sees the pool stopped.
+        if (!isRunning_.load())
+        {
+            finish(std::int64_t(count));
+            return 0;
+        }
+
+        int used = injectedCount_.load(std::memory_order_relaxed);
+        while (used < maxTasks_)
+        {
+            const size_t granted = std::min(count, size_t(maxTasks_ - used));
+            if (injectedCount_.compare_exchange_weak(used, used + int(granted), std::memory_order_relaxed))
             {
-                std::function<void()> task;
-                {
-                    std::unique_lock<std::mutex> lock(tasksMutex_);
-                    condition_.wait(lock, [this] {
-                        return !tasks_.empty() || !isRunning_;
-                        });
-
-                    if (!isRunning_ && tasks_.empty())
-                    {
-                        return; 
-                    }
-                    if (!tasks_.empty())
-                    {
-                        task = std::move(tasks_.front());
-                        tasks_.pop_front();
-                    }
-                }
-                if (task)
-                {
-                    task();
-                }
+                if (granted < count)
+                    finish(std::int64_t(count - granted));
+                return granted;
             }
-        }));
+        }
+
+        if (!block)
+        {
+            finish(std::int64_t(count));
+            return 0;
+        }
+
+        // Sleep until a worker takes a task from the queue or the pool
+        // stops; the wait returns at once if the count already changed.
+        blockedSubmitters_.fetch_add(1);
+        if (used >= maxTasks_ && isRunning_.load())
+            injectedCount_.wait(used);
+        blockedSubmitters_.fetch_sub(1);
     }
 }
 
-void TaskManager::stop()
-{    
+void TaskManager::push(Task* task)
+{
+    pushBulk(&task, 1);
+}
+
+void TaskManager::pushBulk(Task* const* tasks, size_t count)
+{
+    if (currentWorker.pool == this)
+    {
+        Worker& worker = *workers_[currentWorker.index];
+        for (size_t i = 0; i < count; ++i)
+            worker.deques[int(tasks[i]->priority())].push(tasks[i]);
+    }
+    else
     {
-        std::lock_guard<std::mutex> lock(tasksMutex_);
-        if (!isRunning_) return;
-        isRunning_ = false;
+        // Cannot fail, reserve() keeps at most maxTasks tasks queued.
+        for (size_t i = 0; i < count; ++i)
+            injected_[int(tasks[i]->priority())]->push(tasks[i]);
     }
+    wake(count);
+}
+
+Task* TaskManager::findTask(int self)
+{
+    Worker& worker = *workers_[self];
+    for (int level = 0; level < TASK_PRIORITY_COUNT; ++level)
+    {
+        if (Task* task = worker.deques[level].pop())
+            return task;
 
-    condition_.notify_all();
+        if (Task* task = injected_[level]->pop())
+        {
+            injectedCount_.fetch_sub(1);
+            if (blockedSubmitters_.load() > 0)
+                injectedCount_.notify_all();
+            return task;
+        }
+
+        // Work on the same node shares its caches and memory.
+        if (Task* task = steal(worker, worker.nearVictims, level))
+            return task;
+        if (Task* task = steal(worker, worker.farVictims, level))
+            return task;
+    }
+    return nullptr;
+}
+
+Task* TaskManager::steal(Worker& worker, const std::vector<int>& victims, int level)
+{
+    // Visit every victim once, starting at a random one.
+    const size_t count = victims.size();
+    if (count == 0)
+        return nullptr;
+
+    const size_t first = xorshift(worker.rng) % count;
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (Task* task = workers_[victims[(first + i) % count]]->deques[level].steal())
+        {
+            bump(worker.steals, std::uint64_t(1));
+            return task;
+        }
+    }
+    return nullptr;
+}
+
+bool TaskManager::isWorker() const
+{
+    return currentWorker.pool == this;
+}
+
+bool TaskManager::runPending()
+{
+    if (!isWorker())
+        return false;
+
+    Task* task = findTask(currentWorker.index);
+    if (!task)
+        return false;
+    run(task);
+    return true;
+}
+
+void TaskManager::run(Task* task)
+{
+    // Tasks it adds inherit the priority; restored for nested runs.
+    const TaskPriority outer = currentWorker.priority;
+    currentWorker.priority = task->priority();
+    task->run();
+    currentWorker.priority = outer;
+    bump(workers_[currentWorker.index]->tasks, std::uint64_t(1));
+    finish();
+}
+
+void TaskManager::finish(std::int64_t count)
+{
+    // The last task of a stopping pool releases the sleeping workers.
+    if (pending_.fetch_sub(count, std::memory_order_acq_rel) == count && !isRunning_.load())
+    {
+        wakeEpoch_.fetch_add(1, std::memory_order_release);
+        wakeEpoch_.notify_all();
+    }
+}
+
+void TaskManager::wake(size_t count)
+{
+    // Pairs with the fence after a worker announces it is going to sleep:
+    // either it sees the new task or this sees it as a sleeper.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    const int sleepers = sleepers_.load(std::memory_order_relaxed);
+    if (sleepers == 0)
+        return;
+
+    wakeEpoch_.fetch_add(1, std::memory_order_release);
+    if (count >= size_t(sleepers))
+        wakeEpoch_.notify_all();
+    else
+        for (size_t i = 0; i < count; ++i)
+            wakeEpoch_.notify_one();
+}
+
+void TaskManager::workerLoop(int index)
+{
+    Worker& worker = *workers_[index];
+    currentWorker = { this, index, worker.node };
+    timeline::setThreadName("worker " + std::to_string(index));
+    // Unpinned workers still stay on their node, so currentNode() names the
+    // node they actually run on and they read its scene replica.
+    if (pinned_)
+        pinCurrentThread({ worker.cpu });
+    else if (nodeCount() > 1)
+        pinCurrentThread(nodeCpus_[worker.node]);
+
+    // Tasks run while waiting inside this one are part of its time.
+    auto runTimed = [&](Task* task) {
+        const auto start = std::chrono::steady_clock::now();
+        run(task);
+        bump(worker.busyNs, std::int64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count()));
+    };
+
+    while (true)
+    {
+        if (Task* task = findTask(index))
+        {
+            runTimed(task);
+            continue;
+        }
+
+        const std::uint32_t epoch = wakeEpoch_.load(std::memory_order_acquire);
+        sleepers_.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        if (Task* task = findTask(index))
+        {
+            sleepers_.fetch_sub(1, std::memory_order_relaxed);
+            runTimed(task);
+            continue;
+        }
+
+        if (!isRunning_.load() && pending_.load(std::memory_order_acquire) == 0)
+        {
+            sleepers_.fetch_sub(1, std::memory_order_relaxed);
+            break;
+        }
+
+        wakeEpoch_.wait(epoch, std::memory_order_acquire);
+        sleepers_.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    currentWorker = {};
+}
+
+void TaskManager::stop()
+{
+    if (!isRunning_.exchange(false))
+        return;
+
+    wakeEpoch_.fetch_add(1, std::memory_order_release);
+    wakeEpoch_.notify_all();
+    injectedCount_.notify_all();
 
     for (auto& thread : threads_)
     {
@@ -51,4 +483,24 @@ void TaskManager::stop()
             thread.join();
         }
     }
-}
\ No newline at end of file
+}
+
+void TaskGroup::wait()
+{
+    // A worker keeps running tasks, anything it finds may be part of this
+    // group. Other threads sleep until the last task is done.
+    const bool worker = pool_.isWorker();
+    while (true)
+    {
+        const std::int64_t pending = pending_.load(std::memory_order_acquire);
+        if (pending == 0)
+            break;
+        if (!worker)
+            pending_.wait(pending, std::memory_order_acquire);
+        else if (!pool_.runPending())
+            std::this_thread::yield();
+    }
+
+    while (notifying_.load(std::memory_order_acquire) != 0)
+        std::this_thread::yield();
+}
@@ -1,42 +1,600 @@
 #pragma once
 
-#include <condition_variable>
-#include <deque>
-#include <functional>
-#include <mutex>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <future>
+#include <iterator>
+#include <memory>
+#include <new>
 #include <thread>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
-class TaskManager {
+#include "topology.h"
+
+// Chase-Lev work-stealing deque of pointers. The owning thread pushes and
+// pops at the bottom, any other thread steals from the top. The ring grows
+// when full; retired rings are kept until destruction because a thief may
+// still be reading one.
+// [Le et al. 2013, "Correct and Efficient Work-Stealing for Weak Memory
+// Models"]
+template <typename T> class WorkStealingDeque {
 public:
-  TaskManager(int numThreads, int maxTasks);
+  explicit WorkStealingDeque(std::int64_t capacity = 256) {
+    rings_.push_back(std::make_unique<Ring>(capacity));
+    ring_.store(rings_.back().get(), std::memory_order_relaxed);
+  }
 
-  template <typename Callable, typename... Args>
-  bool add(Callable &&func, Args &&...args) {
-    {
-      std::lock_guard<std::mutex> lock(tasksMutex_);
-      if (!isRunning_ || tasks_.size() >= maxTasks_) {
+  WorkStealingDeque(const WorkStealingDeque &) = delete;
+  WorkStealingDeque &operator=(const WorkStealingDeque &) = delete;
+
+  // Owner only.
+  void push(T *item) {
+    const std::int64_t b = bottom_.load(std::memory_order_relaxed);
+    const std::int64_t t = top_.load(std::memory_order_acquire);
+    Ring *ring = ring_.load(std::memory_order_relaxed);
+    if (b - t > ring->mask)
+      ring = grow(ring, t, b);
+    ring->put(b, item);
+    std::atomic_thread_fence(std::memory_order_release);
+    bottom_.store(b + 1, std::memory_order_relaxed);
+  }
+
+  // Owner only, newest first.
+  T *pop() {
+    const std::int64_t b = bottom_.load(std::memory_order_relaxed) - 1;
+    Ring *ring = ring_.load(std::memory_order_relaxed);
+    bottom_.store(b, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    std::int64_t t = top_.load(std::memory_order_relaxed);
+
+    T *item = nullptr;
+    if (t <= b) {
+      item = ring->get(b);
+      if (t == b) {
+        // Last item, race the thieves for it.
+        if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                          std::memory_order_relaxed))
+          item = nullptr;
+        bottom_.store(b + 1, std::memory_order_relaxed);
+      }
+    } else {
+      bottom_.store(b + 1, std::memory_order_relaxed);
+    }
+    return item;
+  }
+
+  // Any thread, oldest first. Null when empty or on a lost race.
+  T *steal() {
+    std::int64_t t = top_.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    const std::int64_t b = bottom_.load(std::memory_order_acquire);
+    if (t >= b)
+      return nullptr;
+
+    T *item = ring_.load(std::memory_order_acquire)->get(t);
+    if (!top_.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                      std::memory_order_relaxed))
+      return nullptr;
+    return item;
+  }
+
+  bool empty() const {
+    return bottom_.load(std::memory_order_relaxed) <=
+           top_.load(std::memory_order_relaxed);
+  }
+
+private:
+  struct Ring {
+    explicit Ring(std::int64_t capacity)
+        : mask(capacity - 1), items(new std::atomic<T *>[capacity]) {}
+
+    T *get(std::int64_t i) const {
+      return items[i & mask].load(std::memory_order_relaxed);
+    }
+    void put(std::int64_t i, T *item) {
+      items[i & mask].store(item, std::memory_order_relaxed);
+    }
+
+    std::int64_t mask;
+    std::unique_ptr<std::atomic<T *>[]> items;
+  };
+
+  Ring *grow(Ring *ring, std::int64_t t, std::int64_t b) {
+    rings_.push_back(std::make_unique<Ring>((ring->mask + 1) * 2));
+    Ring *bigger = rings_.back().get();
+    for (std::int64_t i = t; i < b; ++i)
+      bigger->put(i, ring->get(i));
+    ring_.store(bigger, std::memory_order_release);
+    return bigger;
+  }
+
+  alignas(64) std::atomic<std::int64_t> top_{0};
+  alignas(64) std::atomic<std::int64_t> bottom_{0};
+  std::atomic<Ring *> ring_;
+  std::vector<std::unique_ptr<Ring>> rings_;
+};
+
+// Bounded multi-producer multi-consumer queue of pointers, one sequence
+// number per slot and no locks.
+// [Vyukov, "Bounded MPMC queue"]
+template <typename T> class BoundedQueue {
+public:
+  explicit BoundedQueue(size_t capacity) {
+    size_t size = 2;
+    while (size < capacity)
+      size *= 2;
+    mask_ = size - 1;
+    cells_.reset(new Cell[size]);
+    for (size_t i = 0; i < size; ++i)
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+  }
+
+  bool push(T *item) {
+    size_t pos = tail_.load(std::memory_order_relaxed);
+    while (true) {
+      Cell &cell = cells_[pos & mask_];
+      const size_t seq = cell.sequence.load(std::memory_order_acquire);
+      const std::intptr_t diff = std::intptr_t(seq) - std::intptr_t(pos);
+      if (diff == 0) {
+        if (tail_.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed)) {
+          cell.item = item;
+          cell.sequence.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
         return false;
+      } else {
+        pos = tail_.load(std::memory_order_relaxed);
       }
+    }
+  }
 
-      tasks_.emplace_back(
-          [func = std::forward<Callable>(func),
-           ... args = std::forward<Args>(args)]() mutable { func(args...); });
+  T *pop() {
+    size_t pos = head_.load(std::memory_order_relaxed);
+    while (true) {
+      Cell &cell = cells_[pos & mask_];
+      const size_t seq = cell.sequence.load(std::memory_order_acquire);
+      const std::intptr_t diff = std::intptr_t(seq) - std::intptr_t(pos + 1);
+      if (diff == 0) {
+        if (head_.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed)) {
+          T *item = cell.item;
+          cell.sequence.store(pos + mask_ + 1, std::memory_order_release);
+          return item;
+        }
+      } else if (diff < 0) {
+        return nullptr;
+      } else {
+        pos = head_.load(std::memory_order_relaxed);
+      }
     }
+  }
+
+private:
+  struct Cell {
+    std::atomic<size_t> sequence;
+    T *item = nullptr;
+  };
+
+  std::unique_ptr<Cell[]> cells_;
+  size_t mask_;
+  alignas(64) std::atomic<size_t> head_{0};
+  alignas(64) std::atomic<size_t> tail_{0};
+};
+
+class TaskPool;
+
+// Workers take every task of a higher priority they can find, queued or
+// stolen, before one of a lower.
+enum class TaskPriority : std::uint8_t { High, Normal, Low };
+constexpr int TASK_PRIORITY_COUNT = 3;
+
+// Move-only type-erased closure, stored in the same block as its header.
+// Blocks come from the creating thread's TaskPool; closures up to
+// INLINE_SIZE bytes fit the smallest, one cache line.
+class Task {
+public:
+  static constexpr size_t HEADER_SIZE = 32;
+  static constexpr size_t INLINE_SIZE = 64 - HEADER_SIZE;
+
+  template <typename Callable>
+  static Task *create(Callable &&func,
+                      TaskPriority priority = TaskPriority::Normal) {
+    using Closure = std::decay_t<Callable>;
+    static_assert(alignof(Closure) <= HEADER_SIZE,
+                  "task closure is over-aligned");
+
+    Task *task = allocate(HEADER_SIZE + sizeof(Closure));
+    new (task->storage()) Closure(std::forward<Callable>(func));
+    task->priority_ = priority;
+    task->invoke_ = [](Task *self) {
+      Closure *closure = std::launder(static_cast<Closure *>(self->storage()));
+      (*closure)();
+      closure->~Closure();
+    };
+    return task;
+  }
+
+  // Calls the closure, destroys it and returns the block to its pool.
+  void run();
+  TaskPriority priority() const { return priority_; }
+
+private:
+  friend class TaskPool;
+
+  static Task *allocate(size_t bytes);
+  void *storage() { return reinterpret_cast<char *>(this) + HEADER_SIZE; }
+
+  void (*invoke_)(Task *);
+  TaskPool *owner_;
+  // Free list link while the block is unused.
+  Task *next_;
+  std::uint32_t sizeClass_;
+  TaskPriority priority_;
+};
+
+// Per-thread free lists of task blocks in power of two size classes from
+// one cache line up. A block freed on another thread goes back to its
+// owner through a lock-free stack the owner takes whole when its own list
+// runs dry, so a producer feeding many workers reuses its blocks instead
+// of allocating. Pools outlive their threads and are handed to new ones.
+class TaskPool {
+public:
+  static constexpr int CLASS_COUNT = 6;
+  static constexpr size_t MAX_BLOCK = size_t(64) << (CLASS_COUNT - 1);
+
+  // Blocks obtained from the heap so far, by every pool together. Stays
+  // constant once the pools are warm.
+  static long long heapAllocations();
+
+private:
+  friend class Task;
+
+  static TaskPool &local();
+  Task *allocate(size_t bytes);
+  static void release(Task *task);
+
+  Task *free_[CLASS_COUNT] = {};
+  std::atomic<Task *> remote_[CLASS_COUNT] = {};
+  std::vector<void *> slabs_;
+};
+
+// Work-stealing thread pool. Every worker owns a deque; tasks added from
+// inside a task go to the worker's own deque, tasks from other threads to
+// a shared lock-free queue. Idle workers steal from random victims before
+// they sleep on an atomic wake counter. Submitters that find the shared
+// queue full sleep on its count the same way. Deques and the shared queue
+// come once per priority; a task added without one gets the priority of
+// the task adding it, Normal outside the pool.
+class TaskManager {
+public:
+  // numThreads <= 0 starts one worker per CPU the process may use.
+  // Workers are spread evenly over the NUMA nodes and bound to the CPUs of
+  // their node; pinned workers are restricted to one core each.
+  TaskManager(int numThreads, int maxTasks, bool pinWorkers = false);
+  ~TaskManager();
 
-    condition_.notify_one();
+  // From outside the pool, fails while maxTasks tasks are queued. From a
+  // worker, always succeeds.
+  template <typename Callable, typename... Args>
+  bool add(Callable &&func, Args &&...args) {
+    if (reserve(1, false) == 0)
+      return false;
+    push(makeTask(std::forward<Callable>(func), std::forward<Args>(args)...));
     return true;
   }
 
+  // Sleeps while the queue is full instead of failing. The future holds
+  // the result; it reports a broken promise if the pool was stopped.
+  template <typename Callable, typename... Args>
+  auto submit(Callable &&func, Args &&...args)
+      -> std::future<std::invoke_result_t<std::decay_t<Callable> &,
+                                          std::decay_t<Args> &...>> {
+    using Result = std::invoke_result_t<std::decay_t<Callable> &,
+                                        std::decay_t<Args> &...>;
+    std::packaged_task<Result()> task(
+        [func = std::forward<Callable>(func),
+         ... args = std::forward<Args>(args)]() mutable {
+          return func(args...);
+        });
+    std::future<Result> future = task.get_future();
+    enqueue([task = std::move(task)]() mutable { task(); });
+    return future;
+  }
+
+  // Submits fn(*it) for every iterator in [first, last), blocking like
+  // submit. Each round takes as many queue slots as are free, pushes that
+  // many tasks and wakes the workers once. Every task holds a copy of fn;
+  // the range must outlive them. Returns the number of tasks submitted,
+  // short of the range only if the pool was stopped.
+  template <typename Iterator, typename Fn>
+  size_t submitBulk(Iterator first, Iterator last, const Fn &fn,
+                    TaskPriority priority = currentPriority()) {
+    Task *batch[BULK_SIZE];
+    size_t submitted = 0;
+    while (first != last) {
+      const size_t granted = reserve(
+          std::min<size_t>(std::distance(first, last), BULK_SIZE), true);
+      if (granted == 0)
+        break;
+
+      for (size_t i = 0; i < granted; ++i, ++first)
+        batch[i] = Task::create([fn, first]() { fn(*first); }, priority);
+      pushBulk(batch, granted);
+      submitted += granted;
+    }
+    return submitted;
+  }
+
+  // Runs one queued task on the calling thread if it is a worker of this
+  // pool, so tasks waiting for other tasks keep their worker busy.
+  bool runPending();
+  bool isWorker() const;
+
+  int threadCount() const { return int(threads_.size()); }
+  // NUMA nodes with workers, numbered from 0 in the order of the system's.
+  int nodeCount() const { return int(nodeCpus_.size()); }
+  bool pinned() const { return pinned_; }
+  // Node of the calling worker, 0 for threads outside any pool.
+  static int currentNode();
+  // Priority of the task running on the calling thread, Normal outside.
+  static TaskPriority currentPriority();
+
+  struct WorkerStats {
+    int node;
+    int cpu;
+    std::uint64_t tasks;
+    // Tasks taken from other workers' deques.
+    std::uint64_t steals;
+    // Time spent in tasks, nested ones counted once.
+    double busySeconds;
+  };
+  // Totals since the pool started, readable while it runs.
+  std::vector<WorkerStats> workerStats() const;
+
+  // Runs fn on a temporary thread restricted to the CPUs of node and
+  // returns when it is done, so memory fn touches first is allocated on
+  // that node.
+  template <typename Fn> void runOnNode(int node, Fn &&fn) {
+    std::thread thread([this, node, &fn]() {
+      pinCurrentThread(nodeCpus_[node]);
+      fn();
+    });
+    thread.join();
+  }
+
+  // Runs everything queued, including tasks those tasks add, then joins
+  // the workers.
   void stop();
 
 private:
-  std::mutex tasksMutex_;
-  std::deque<std::function<void()>> tasks_;
-  int maxTasks_;
+  friend class TaskGroup;
 
+  // Tasks pushed per queue operation of submitBulk.
+  static constexpr size_t BULK_SIZE = 64;
+
+  struct alignas(64) Worker {
+    WorkStealingDeque<Task> deques[TASK_PRIORITY_COUNT];
+    std::uint32_t rng;
+    int node;
+    int cpu;
+    // Steal targets on the same node, tried first, and on the others.
+    std::vector<int> nearVictims;
+    std::vector<int> farVictims;
+    // Written by the worker only, read by workerStats().
+    std::atomic<std::uint64_t> tasks{0};
+    std::atomic<std::uint64_t> steals{0};
+    std::atomic<std::int64_t> busyNs{0};
+  };
+
+  template <typename Callable, typename... Args>
+  static Task *makeTask(Callable &&func, Args &&...args) {
+    if constexpr (sizeof...(Args) == 0)
+      return Task::create(std::forward<Callable>(func), currentPriority());
+    else
+      return Task::create(
+          [func = std::forward<Callable>(func),
+           ... args = std::forward<Args>(args)]() mutable { func(args...); },
+          currentPriority());
+  }
+
+  // Blocking add for callers that track completion themselves.
+  template <typename Callable>
+  bool enqueue(Callable &&func, TaskPriority priority = currentPriority()) {
+    if (reserve(1, true) == 0)
+      return false;
+    push(Task::create(std::forward<Callable>(func), priority));
+    return true;
+  }
+
+  // Counts up to count tasks about to be pushed and returns how many may
+  // be, 0 once stopped. Blocking waits for a free slot of the queue.
+  size_t reserve(size_t count, bool block);
+  void push(Task *task);
+  void pushBulk(Task *const *tasks, size_t count);
+  Task *findTask(int self);
+  Task *steal(Worker &worker, const std::vector<int> &victims, int level);
+  void run(Task *task);
+  // Uncounts finished or rejected tasks.
+  void finish(std::int64_t count = 1);
+  void workerLoop(int index);
+  void wake(size_t count = 1);
+
+  std::vector<std::unique_ptr<Worker>> workers_;
   std::vector<std::thread> threads_;
-  std::condition_variable condition_;
-  bool isRunning_;
+  std::vector<std::vector<int>> nodeCpus_;
+  bool pinned_;
+  std::unique_ptr<BoundedQueue<Task>> injected_[TASK_PRIORITY_COUNT];
+  int maxTasks_;
+
+  // Tasks added but not finished.
+  alignas(64) std::atomic<std::int64_t> pending_{0};
+  // Tasks in the shared queue, for the maxTasks limit.
+  std::atomic<int> injectedCount_{0};
+  // Submitters blocked on a full queue.
+  std::atomic<int> blockedSubmitters_{0};
+  alignas(64) std::atomic<std::uint32_t> wakeEpoch_{0};
+  std::atomic<int> sleepers_{0};
+  std::atomic<bool> isRunning_{true};
 };
+
+// Valid until the generation it was taken from advances. Long running
+// tasks poll cancelled() and return early; results computed under a
+// cancelled token are stale. A default token is never cancelled.
+class CancellationToken {
+public:
+  CancellationToken() = default;
+  explicit CancellationToken(const std::atomic<std::uint64_t> &counter)
+      : counter_(&counter),
+        generation_(counter.load(std::memory_order_acquire)) {}
+
+  bool cancelled() const {
+    return counter_ &&
+           counter_->load(std::memory_order_acquire) != generation_;
+  }
+  std::uint64_t generation() const { return generation_; }
+
+private:
+  const std::atomic<std::uint64_t> *counter_ = nullptr;
+  std::uint64_t generation_ = 0;
+};
+
+// Counts how often the work in flight went stale, for example because the
+// camera moved. advance() cancels every token taken so far.
+class Generation {
+public:
+  CancellationToken token() const { return CancellationToken(value_); }
+  void advance() { value_.fetch_add(1, std::memory_order_acq_rel); }
+  std::uint64_t current() const {
+    return value_.load(std::memory_order_acquire);
+  }
+
+private:
+  std::atomic<std::uint64_t> value_{0};
+};
+
+// Tasks whose completion can be waited for while the pool keeps running.
+// Waiting on a worker runs other tasks in the meantime, so groups nest.
+// Tasks of a group whose token is cancelled before they start are
+// skipped.
+class TaskGroup {
+public:
+  explicit TaskGroup(TaskManager &pool,
+                     TaskPriority priority = TaskManager::currentPriority(),
+                     CancellationToken token = {})
+      : pool_(pool), priority_(priority), token_(token) {}
+  ~TaskGroup() { wait(); }
+
+  TaskGroup(const TaskGroup &) = delete;
+  TaskGroup &operator=(const TaskGroup &) = delete;
+
+  template <typename Callable> void run(Callable &&func) {
+    pending_.fetch_add(1, std::memory_order_relaxed);
+    if (!pool_.enqueue(
+            [this, func = std::forward<Callable>(func)]() mutable {
+              if (!token_.cancelled())
+                func();
+              done(1);
+            },
+            priority_))
+      done(1);
+  }
+
+  // fn(*it) for every iterator in [first, last), submitted in bulk. fn
+  // must outlive the tasks.
+  template <typename Iterator, typename Fn>
+  void runBulk(Iterator first, Iterator last, const Fn &fn) {
+    const std::int64_t count = std::distance(first, last);
+    pending_.fetch_add(count, std::memory_order_relaxed);
+    const size_t submitted = pool_.submitBulk(
+        first, last,
+        [this, &fn](auto &item) {
+          if (!token_.cancelled())
+            fn(item);
+          done(1);
+        },
+        priority_);
+    // Tasks a stopped pool rejected never run.
+    if (std::int64_t(submitted) < count)
+      done(count - std::int64_t(submitted));
+  }
+
+  void wait();
+  const CancellationToken &token() const { return token_; }
+
+private:
+  void done(std::int64_t count) {
+    // wait() returns only after the notify, the group may be destroyed
+    // right after.
+    notifying_.fetch_add(1, std::memory_order_acquire);
+    if (pending_.fetch_sub(count, std::memory_order_acq_rel) == count)
+      pending_.notify_all();
+    notifying_.fetch_sub(1, std::memory_order_release);
+  }
+
+  TaskManager &pool_;
+  TaskPriority priority_;
+  CancellationToken token_;
+  std::atomic<std::int64_t> pending_{0};
+  std::atomic<int> notifying_{0};
+};
+
+namespace detail {
+
+// Keeps the first half of the range, hands the second to the group and
+// repeats until the range fits the grain size.
+template <typename Fn>
+void splitRange(TaskGroup &group, size_t begin, size_t end, size_t grain,
+                const Fn &fn) {
+  while (end - begin > grain) {
+    const size_t mid = begin + (end - begin) / 2;
+    group.run([&group, mid, end, grain, &fn]() {
+      splitRange(group, mid, end, grain, fn);
+    });
+    end = mid;
+  }
+  fn(begin, end);
+}
+
+} // namespace detail
+
+// Runs fn(b, e) over sub-ranges of [begin, end) no longer than grain and
+// returns once all are done. Ranges are split recursively, so idle workers
+// steal large halves instead of single chunks.
+template <typename Fn>
+void parallelFor(TaskManager &pool, size_t begin, size_t end, size_t grain,
+                 const Fn &fn) {
+  if (end <= begin)
+    return;
+
+  grain = std::max<size_t>(1, grain);
+  TaskGroup group(pool);
+  group.run([&]() { detail::splitRange(group, begin, end, grain, fn); });
+  group.wait();
+}
+
+// Folds map(b, e) of consecutive grain sized sub-ranges of [begin, end)
+// with reduce, in range order so the result does not depend on timing.
+template <typename T, typename Map, typename Reduce>
+T parallelReduce(TaskManager &pool, size_t begin, size_t end, size_t grain,
+                 T identity, const Map &map, const Reduce &reduce) {
+  if (end <= begin)
+    return identity;
+
+  grain = std::max<size_t>(1, grain);
+  const size_t chunks = (end - begin + grain - 1) / grain;
+  std::vector<T> partial(chunks, identity);
+  parallelFor(pool, 0, chunks, 1, [&](size_t first, size_t last) {
+    for (size_t c = first; c < last; ++c)
+      partial[c] = map(begin + c * grain, std::min(end, begin + (c + 1) * grain));
+  });
+
+  T result = identity;
+  for (const T &value : partial)
+    result = reduce(result, value);
+  return result;
+}
@@ -0,0 +1,154 @@
+#include "denoise.h"
+
+#include "concurrency.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+	constexpr float ALBEDO_EPS = 1e-3f;
+
+	float demodulate(float c, float albedo)
+	{
+		return albedo > ALBEDO_EPS ? c / albedo : c;
+	}
+
+	float remodulate(float c, float albedo)
+	{
+		return albedo > ALBEDO_EPS ? c * albedo : c;
+	}
+}
+
+void AOVBuffers::resize(size_t count)
+{
+	albedo.assign(count, Vector3());
+	normal.assign(count, Vector3());
+	depth.assign(count, 0.0f);
+	variance.assign(count, 0.0f);
+}
+
+std::vector<Vector3> denoise(const std::vector<Vector3>& color, const AOVBuffers& aov, int width, int height, const DenoiseSettings& settings, TaskManager& pool)
+{
+	const size_t count = color.size();
+
+	// Filter illumination rather than radiance, so texture and material
+	// edges survive; the variance is demodulated the same way.
+	std::vector<Vector3> illum(count);
+	std::vector<float> variance(count);
+	for (size_t i = 0; i < count; ++i)
+	{
+		const Vector3& a = aov.albedo[i];
+		illum[i] = Vector3(demodulate(color[i].x(), a.x()), demodulate(color[i].y(), a.y()), demodulate(color[i].z(), a.z()));
+		const float la = math::luminance(a);
+		variance[i] = la > ALBEDO_EPS ? aov.variance[i] / (la * la) : aov.variance[i];
+	}
+
+	std::vector<Vector3> nextIllum(count);
+	std::vector<float> nextVariance(count);
+
+	const float kernel[3] = { 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+
+	for (int iteration = 0; iteration < settings.iterations; ++iteration)
+	{
+		const int step = 1 << iteration;
+
+		parallelFor(pool, 0, size_t(height), 4, [&](size_t begin, size_t end) {
+			for (int y = int(begin); y < int(end); ++y)
+			{
+				for (int x = 0; x < width; ++x)
+				{
+					const int p = y * width + x;
+					const Vector3& np = aov.normal[p];
+					const float zp = aov.depth[p];
+
+					// Background and emitters without geometry info stay as they are.
+					if (zp <= 0.0f)
+					{
+						nextIllum[p] = illum[p];
+						nextVariance[p] = variance[p];
+						continue;
+					}
+
+					// A few samples give a poor variance estimate, so the edge
+					// stopping function uses a 3x3 blur of it.
+					float blurred = 0.0f;
+					float blurWeight = 0.0f;
+					for (int dy = -1; dy <= 1; ++dy)
+					{
+						for (int dx = -1; dx <= 1; ++dx)
+						{
+							const int qx = x + dx;
+							const int qy = y + dy;
+							if (qx < 0 || qx >= width || qy < 0 || qy >= height)
+								continue;
+							const float k = (dx == 0 ? 0.5f : 0.25f) * (dy == 0 ? 0.5f : 0.25f);
+							blurred += k * variance[qy * width + qx];
+							blurWeight += k;
+						}
+					}
+
+					const float lp = math::luminance(illum[p]);
+					const float colorScale = settings.sigmaColor * std::sqrt(std::max(blurred / blurWeight, 0.0f)) + 1e-4f;
+					const float depthScale = settings.sigmaDepth * step * zp;
+
+					Vector3 sum;
+					float sumVariance = 0.0f;
+					float sumWeight = 0.0f;
+
+					for (int dy = -2; dy <= 2; ++dy)
+					{
+						const int qy = y + dy * step;
+						if (qy < 0 || qy >= height)
+							continue;
+
+						for (int dx = -2; dx <= 2; ++dx)
+						{
+							const int qx = x + dx * step;
+							if (qx < 0 || qx >= width)
+								continue;
+
+							const int q = qy * width + qx;
+							const float zq = aov.depth[q];
+							if (zq <= 0.0f)
+								continue;
+
+							const float h = kernel[std::abs(dx)] * kernel[std::abs(dy)];
+							const float wn = std::pow(std::max(0.0f, dot(np, aov.normal[q])), settings.sigmaNormal);
+							const float wz = std::abs(zp - zq) / depthScale;
+							const float wl = std::abs(lp - math::luminance(illum[q])) / colorScale;
+							const float w = h * wn * std::exp(-wz - wl);
+
+							sum += illum[q] * w;
+							sumVariance += w * w * variance[q];
+							sumWeight += w;
+						}
+					}
+
+					if (sumWeight > 0.0f)
+					{
+						nextIllum[p] = sum / sumWeight;
+						nextVariance[p] = sumVariance / (sumWeight * sumWeight);
+					}
+					else
+					{
+						nextIllum[p] = illum[p];
+						nextVariance[p] = variance[p];
+					}
+				}
+			}
+			});
+
+		illum.swap(nextIllum);
+		variance.swap(nextVariance);
+	}
+
+	std::vector<Vector3> result(count);
+	for (size_t i = 0; i < count; ++i)
+	{
+		const Vector3& a = aov.albedo[i];
+		result[i] = Vector3(remodulate(illum[i].x(), a.x()), remodulate(illum[i].y(), a.y()), remodulate(illum[i].z(), a.z()));
+	}
+	return result;
+}
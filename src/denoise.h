@@ -0,0 +1,33 @@
+#pragma once
+
+#include "vector.h"
+
+#include <vector>
+
+class TaskManager;
+
+// Auxiliary buffers from the first camera hit.
+struct AOVBuffers {
+  std::vector<Vector3> albedo;
+  std::vector<Vector3> normal;
+  std::vector<float> depth;
+  // Variance of the pixel mean, in luminance.
+  std::vector<float> variance;
+
+  void resize(size_t count);
+};
+
+struct DenoiseSettings {
+  int iterations = 5;
+  // Edge stopping: luminance difference in standard deviations, normal
+  // cosine exponent and relative depth difference.
+  float sigmaColor = 4.0f;
+  float sigmaNormal = 128.0f;
+  float sigmaDepth = 0.05f;
+};
+
+// Edge-avoiding a-trous wavelet filter on albedo-demodulated radiance.
+std::vector<Vector3> denoise(const std::vector<Vector3> &color,
+                             const AOVBuffers &aov, int width, int height,
+                             const DenoiseSettings &settings,
+                             TaskManager &pool);
@@ -0,0 +1,258 @@
+#include "environment.h"
+
+#include "utils.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+namespace {
+
+	bool readPFM(std::ifstream& in, int& width, int& height, std::vector<Vector3>& texels)
+	{
+		std::string magic;
+		float scale = 0.0f;
+		in >> magic >> width >> height >> scale;
+		in.get(); // single whitespace before the data
+		if (!in || (magic != "PF" && magic != "Pf") || width <= 0 || height <= 0)
+			return false;
+
+		const int channels = magic == "PF" ? 3 : 1;
+		std::vector<float> data(size_t(width) * height * channels);
+		in.read(reinterpret_cast<char*>(data.data()), data.size() * sizeof(float));
+		if (!in)
+			return false;
+
+		// Positive scale is big endian; the data is assumed to be read on a
+		// little endian host.
+		if (scale > 0.0f)
+		{
+			for (float& v : data)
+			{
+				std::uint32_t bits;
+				std::memcpy(&bits, &v, sizeof(bits));
+				bits = (bits >> 24) | ((bits >> 8) & 0xff00) | ((bits << 8) & 0xff0000) | (bits << 24);
+				std::memcpy(&v, &bits, sizeof(bits));
+			}
+		}
+
+		// Rows are stored bottom to top.
+		texels.resize(size_t(width) * height);
+		for (int y = 0; y < height; ++y)
+		{
+			for (int x = 0; x < width; ++x)
+			{
+				const float* p = &data[(size_t(height - 1 - y) * width + x) * channels];
+				texels[size_t(y) * width + x] = channels == 3 ? Vector3(p[0], p[1], p[2]) : Vector3(p[0], p[0], p[0]);
+			}
+		}
+		return true;
+	}
+
+	bool readScanline(std::ifstream& in, int width, std::vector<std::uint8_t>& rgbe)
+	{
+		std::uint8_t head[4];
+		if (!in.read(reinterpret_cast<char*>(head), 4))
+			return false;
+
+		// Adaptive run length encoding stores each component separately.
+		if (head[0] == 2 && head[1] == 2 && !(head[2] & 0x80) && width >= 8 && width < 32768)
+		{
+			if (((head[2] << 8) | head[3]) != width)
+				return false;
+
+			for (int c = 0; c < 4; ++c)
+			{
+				for (int x = 0; x < width; )
+				{
+					int count = in.get();
+					if (count == EOF)
+						return false;
+
+					if (count > 128)
+					{
+						count -= 128;
+						const int value = in.get();
+						if (value == EOF || x + count > width)
+							return false;
+						for (int i = 0; i < count; ++i)
+							rgbe[size_t(x++) * 4 + c] = std::uint8_t(value);
+					}
+					else
+					{
+						if (count == 0 || x + count > width)
+							return false;
+						for (int i = 0; i < count; ++i)
+							rgbe[size_t(x++) * 4 + c] = std::uint8_t(in.get());
+					}
+				}
+			}
+			return bool(in);
+		}
+
+		// Flat pixels
+		std::memcpy(rgbe.data(), head, 4);
+		return bool(in.read(reinterpret_cast<char*>(rgbe.data() + 4), (size_t(width) - 1) * 4));
+	}
+
+	bool readHDR(std::ifstream& in, int& width, int& height, std::vector<Vector3>& texels)
+	{
+		std::string line;
+		if (!std::getline(in, line) || line.rfind("#?", 0) != 0)
+			return false;
+
+		while (std::getline(in, line) && !line.empty())
+		{
+			if (line.rfind("FORMAT=", 0) == 0 && line != "FORMAT=32-bit_rle_rgbe")
+				return false;
+		}
+
+		// Only the standard top-to-bottom, left-to-right orientation.
+		char axisY[3] = {}, axisX[3] = {};
+		if (!std::getline(in, line) || std::sscanf(line.c_str(), "%2s %d %2s %d", axisY, &height, axisX, &width) != 4 ||
+			std::strcmp(axisY, "-Y") || std::strcmp(axisX, "+X") || width <= 0 || height <= 0)
+			return false;
+
+		texels.resize(size_t(width) * height);
+		std::vector<std::uint8_t> rgbe(size_t(width) * 4);
+		for (int y = 0; y < height; ++y)
+		{
+			if (!readScanline(in, width, rgbe))
+				return false;
+
+			for (int x = 0; x < width; ++x)
+			{
+				const std::uint8_t* p = &rgbe[size_t(x) * 4];
+				const float f = p[3] ? std::ldexp(1.0f, int(p[3]) - (128 + 8)) : 0.0f;
+				texels[size_t(y) * width + x] = Vector3(p[0] * f, p[1] * f, p[2] * f);
+			}
+		}
+		return true;
+	}
+
+	Vector3 directionFromUV(float u, float v)
+	{
+		const float phi = (u - 0.5f) * 2.0f * PI;
+		const float theta = v * PI;
+		const float sinTheta = std::sin(theta);
+		return Vector3(sinTheta * std::sin(phi), std::cos(theta), -sinTheta * std::cos(phi));
+	}
+
+	// Index of the interval of a cumulative table that holds target, and the
+	// position inside it.
+	size_t sampleCdf(const float* cdf, size_t count, float target, float& offset)
+	{
+		const size_t i = std::min<size_t>(std::upper_bound(cdf, cdf + count + 1, target) - cdf, count) - 1;
+		const float width = cdf[i + 1] - cdf[i];
+		offset = width > 0.0f ? math::saturate((target - cdf[i]) / width) : 0.5f;
+		return i;
+	}
+}
+
+bool EnvironmentMap::load(const std::string& fileName, float intensity)
+{
+	std::ifstream in(fileName, std::ios::binary);
+	if (!in)
+	{
+		std::cerr << "Can`t open file " << fileName << std::endl;
+		return false;
+	}
+
+	const bool pfm = in.peek() == 'P';
+	if (!(pfm ? readPFM(in, width_, height_, texels_) : readHDR(in, width_, height_, texels_)))
+	{
+		std::cerr << "Unsupported environment map " << fileName << std::endl;
+		width_ = height_ = 0;
+		texels_.clear();
+		return false;
+	}
+
+	for (Vector3& t : texels_)
+		t = t * intensity;
+
+	buildDistribution();
+	return true;
+}
+
+void EnvironmentMap::buildDistribution()
+{
+	const size_t stride = size_t(width_) + 1;
+	conditional_.assign(stride * height_, 0.0f);
+	rowWeight_.assign(height_, 0.0f);
+	marginal_.assign(size_t(height_) + 1, 0.0f);
+
+	for (int y = 0; y < height_; ++y)
+	{
+		const float sinTheta = std::sin(PI * (y + 0.5f) / height_);
+		float* cdf = &conditional_[y * stride];
+		for (int x = 0; x < width_; ++x)
+			cdf[x + 1] = cdf[x] + math::luminance(texels_[size_t(y) * width_ + x]) * sinTheta;
+
+		rowWeight_[y] = cdf[width_];
+		marginal_[y + 1] = marginal_[y] + rowWeight_[y];
+	}
+	total_ = marginal_[height_];
+}
+
+size_t EnvironmentMap::texel(const Vector3& direction) const
+{
+	const float u = std::atan2(direction.x(), -direction.z()) / (2.0f * PI) + 0.5f;
+	const float v = std::acos(std::clamp(direction.y(), -1.0f, 1.0f)) / PI;
+	const int x = std::clamp(int(u * width_), 0, width_ - 1);
+	const int y = std::clamp(int(v * height_), 0, height_ - 1);
+	return size_t(y) * width_ + x;
+}
+
+Vector3 EnvironmentMap::eval(const Vector3& direction) const
+{
+	if (empty())
+		return Vector3();
+	return texels_[texel(direction)];
+}
+
+EnvironmentSample EnvironmentMap::sample(float u0, float u1) const
+{
+	EnvironmentSample s;
+	s.pdf = 0.0f;
+	if (empty() || total_ <= 0.0f)
+		return s;
+
+	float dy, dx;
+	const size_t y = sampleCdf(marginal_.data(), height_, u0 * total_, dy);
+	const float* cdf = &conditional_[y * (size_t(width_) + 1)];
+	const size_t x = sampleCdf(cdf, width_, u1 * rowWeight_[y], dx);
+
+	const float u = (x + dx) / width_;
+	const float v = (y + dy) / height_;
+	s.direction = directionFromUV(u, v);
+	s.radiance = texels_[y * width_ + x];
+
+	const float sinTheta = std::sin(v * PI);
+	if (sinTheta <= 0.0f)
+		return s;
+
+	const float weight = cdf[x + 1] - cdf[x];
+	s.pdf = weight / total_ * float(width_) * height_ / (2.0f * PI * PI * sinTheta);
+	return s;
+}
+
+float EnvironmentMap::pdf(const Vector3& direction) const
+{
+	if (empty() || total_ <= 0.0f)
+		return 0.0f;
+
+	const float sinTheta = std::sqrt(std::max(0.0f, 1.0f - direction.y() * direction.y()));
+	if (sinTheta <= 0.0f)
+		return 0.0f;
+
+	const size_t i = texel(direction);
+	const size_t x = i % width_;
+	const size_t y = i / width_;
+	const float* cdf = &conditional_[y * (size_t(width_) + 1)];
+	const float weight = cdf[x + 1] - cdf[x];
+	return weight / total_ * float(width_) * height_ / (2.0f * PI * PI * sinTheta);
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "vector.h"
+
+#include <string>
+#include <vector>
+
+struct EnvironmentSample {
+  Vector3 direction;
+  Vector3 radiance;
+  // Solid angle density.
+  float pdf;
+};
+
+// Equirectangular HDR light at infinity, +Y up. Directions are importance
+// sampled from a marginal/conditional CDF over luminance * sin(theta).
+class EnvironmentMap {
+public:
+  // Reads a PFM or Radiance HDR (.hdr, .pic) image.
+  bool load(const std::string &fileName, float intensity = 1.0f);
+
+  bool empty() const { return width_ == 0; }
+
+  Vector3 eval(const Vector3 &direction) const;
+  EnvironmentSample sample(float u0, float u1) const;
+  float pdf(const Vector3 &direction) const;
+
+private:
+  void buildDistribution();
+  size_t texel(const Vector3 &direction) const;
+
+  int width_ = 0;
+  int height_ = 0;
+  std::vector<Vector3> texels_;
+  // Unnormalized running sums: per row over texels (width + 1 entries each)
+  // and over rows.
+  std::vector<float> conditional_;
+  std::vector<float> rowWeight_;
+  std::vector<float> marginal_;
+  float total_ = 0.0f;
+};
@@ -18,6 +18,7 @@
 
 #include "vector.h"
 #include "matrix.h"
+#include "timeline.h"
 
 namespace {
 
@@ -845,36 +846,62 @@ namespace gltf {
 
 	bool parse(const char* fileName, Scene& scene)
 	{
+		timeline::Scope scope("load glTF", fileName);
 		std::ifstream file(fileName);
 		if (!file.is_open()) {
 			std::cerr << "Can`t open file " << fileName << std::endl;
 			return false;
 		}
 
-		std::stringstream buffer;
-		buffer << file.rdbuf();
-
-		std::string s = buffer.str();
-		Lexer lexer(s);
-		Parser parser(lexer);
-		Parser::SceneFile gltfScene = parser.parseSceneFile();
+		std::string s;
+		{
+			timeline::Scope read("read glTF");
+			std::stringstream buffer;
+			buffer << file.rdbuf();
+			s = buffer.str();
+		}
 
+		// The lexer runs on demand of the parser, both are one event.
+		Parser::SceneFile gltfScene;
+		{
+			timeline::Scope parse("lex and parse glTF");
+			Lexer lexer(s);
+			Parser parser(lexer);
+			gltfScene = parser.parseSceneFile();
+		}
 
 		GltfBin bin;
-		bin.loadFromFile("../scenes/" + gltfScene.buffers[0].uri);
+		{
+			const std::string path = "../scenes/" + gltfScene.buffers[0].uri;
+			timeline::Scope load("load .bin", path.c_str());
+			bin.loadFromFile(path);
+		}
+
+		// Scene indices of the glTF materials, duplicates are merged.
+		std::vector<size_t> materialIndices;
+		for (const auto& m : gltfScene.materials)
+		{
+			Material mat;
+			mat.albedo = Vector3(m.baseColorFactor.x(), m.baseColorFactor.y(), m.baseColorFactor.z());
+			mat.emission = m.emissiveFactor * m.emissiveStrength;
+			mat.metallic = m.metallicFactor;
+			mat.roughness = m.roughnessFactor;
+			materialIndices.push_back(scene.addMaterial(mat));
+		}
 
 		for (const auto& node : gltfScene.nodes)
 		{
 			if (node.mesh.has_value())
 			{
 				std::string name = gltfScene.meshes[*node.mesh].name;
+				timeline::Scope mesh("convert mesh", name.c_str());
 				for (const auto& prim : gltfScene.meshes[*node.mesh].primitives)
 				{
 
 					std::vector<int> indices;
 					std::vector<Vector3> positions;
 					std::vector<Vector3> normals;
-					size_t matIndex = prim.material;
+					size_t matIndex = materialIndices[prim.material];
 					{
 						const auto acc = gltfScene.accessors[prim.indices];
 						const auto view = gltfScene.bufferViews[acc.bufferView];
@@ -967,16 +994,6 @@ namespace gltf {
 			}
 		}
 
-		for (const auto& m : gltfScene.materials)
-		{
-			Material mat;
-			mat.albedo = Vector3(m.baseColorFactor.x(), m.baseColorFactor.y(), m.baseColorFactor.z());
-			mat.emission = m.emissiveFactor * m.emissiveStrength;
-			mat.metallic = m.metallicFactor;
-			mat.roughness = m.roughnessFactor;
-			scene.addMaterial(mat);
-		}
-
 		return true;
 	}
 }
\ No newline at end of file
@@ -0,0 +1,303 @@
+#include "guiding.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <functional>
+
+namespace {
+
+	constexpr int MAX_DEPTH = 20;
+	constexpr size_t NODE_BYTES = 4 * sizeof(float) + 4 * sizeof(std::uint32_t);
+
+	void directionToSquare(const Vector3& d, float& u, float& v)
+	{
+		u = std::clamp((d.y() + 1.0f) * 0.5f, 0.0f, 0.99999994f);
+		v = std::atan2(d.z(), d.x()) / (2.0f * PI);
+		if (v < 0.0f)
+			v += 1.0f;
+		v = std::min(v, 0.99999994f);
+	}
+
+	Vector3 squareToDirection(float u, float v)
+	{
+		const float cosTheta = 2.0f * u - 1.0f;
+		const float sinTheta = std::sqrt(std::max(0.0f, 1.0f - cosTheta * cosTheta));
+		const float phi = 2.0f * PI * v;
+		return Vector3(sinTheta * std::cos(phi), cosTheta, sinTheta * std::sin(phi));
+	}
+
+	// Picks quadrant x + 2 y of a node by its energy and rescales u, v into it.
+	int sampleQuadrant(const float* sums, float& u, float& v)
+	{
+		const float left = sums[0] + sums[2];
+		const float total = left + sums[1] + sums[3];
+		int x = 0;
+		const float pLeft = left / total;
+		if (u < pLeft)
+			u = pLeft > 0.0f ? u / pLeft : 0.0f;
+		else
+		{
+			u = (u - pLeft) / (1.0f - pLeft);
+			x = 1;
+		}
+
+		const float column = sums[x] + sums[x + 2];
+		const float pBottom = column > 0.0f ? sums[x] / column : 0.5f;
+		int y = 0;
+		if (v < pBottom)
+			v = pBottom > 0.0f ? v / pBottom : 0.0f;
+		else
+		{
+			v = (v - pBottom) / (1.0f - pBottom);
+			y = 1;
+		}
+
+		u = std::min(u, 0.99999994f);
+		v = std::min(v, 0.99999994f);
+		return x + 2 * y;
+	}
+
+	int quadrant(float& u, float& v)
+	{
+		const int x = u >= 0.5f;
+		const int y = v >= 0.5f;
+		u = u * 2.0f - x;
+		v = v * 2.0f - y;
+		return x + 2 * y;
+	}
+}
+
+std::uint32_t DTree::QuadTree::addNode()
+{
+	sums.insert(sums.end(), 4, 0.0f);
+	children.insert(children.end(), 4, 0u);
+	return std::uint32_t(nodeCount() - 1);
+}
+
+DTree::DTree()
+{
+	sampling_.addNode();
+	recording_.addNode();
+}
+
+void DTree::record(const Vector3& direction, float value)
+{
+	float u, v;
+	directionToSquare(direction, u, v);
+
+	std::uint32_t node = 0;
+	for (int depth = 0; depth < MAX_DEPTH; ++depth)
+	{
+		const int q = quadrant(u, v);
+		std::atomic_ref<float>(recording_.sums[node * 4 + q]).fetch_add(value, std::memory_order_relaxed);
+
+		node = recording_.children[node * 4 + q];
+		if (node == 0)
+			break;
+	}
+}
+
+Vector3 DTree::sample(float u0, float u1) const
+{
+	if (empty())
+		return squareToDirection(u0, u1);
+
+	float x = 0.0f, y = 0.0f, size = 1.0f;
+	std::uint32_t node = 0;
+	while (true)
+	{
+		const float* sums = &sampling_.sums[node * 4];
+		if (sums[0] + sums[1] + sums[2] + sums[3] <= 0.0f)
+			break;
+
+		const int q = sampleQuadrant(sums, u0, u1);
+		size *= 0.5f;
+		x += (q & 1) * size;
+		y += (q >> 1) * size;
+
+		node = sampling_.children[node * 4 + q];
+		if (node == 0)
+			break;
+	}
+	return squareToDirection(x + u0 * size, y + u1 * size);
+}
+
+float DTree::pdf(const Vector3& direction) const
+{
+	const float uniform = 1.0f / (4.0f * PI);
+	if (empty())
+		return uniform;
+
+	float u, v;
+	directionToSquare(direction, u, v);
+
+	float density = 1.0f;
+	std::uint32_t node = 0;
+	while (true)
+	{
+		const float* sums = &sampling_.sums[node * 4];
+		const float total = sums[0] + sums[1] + sums[2] + sums[3];
+		if (total <= 0.0f)
+			break;
+
+		const int q = quadrant(u, v);
+		density *= 4.0f * sums[q] / total;
+
+		node = sampling_.children[node * 4 + q];
+		if (node == 0 || density <= 0.0f)
+			break;
+	}
+	return density * uniform;
+}
+
+void DTree::build(float threshold, size_t maxNodes)
+{
+	const float* root = recording_.sums.data();
+	const float total = root[0] + root[1] + root[2] + root[3];
+	if (total <= 0.0f)
+		return;
+
+	QuadTree next;
+	next.addNode();
+	next.total = total;
+
+	// Copies energy and subdivides cells above the threshold; cells that
+	// were not subdivided while recording split their energy evenly.
+	std::function<void(std::uint32_t, const float*, std::uint32_t, int)> copy = [&](std::uint32_t source, const float* sums, std::uint32_t target, int depth) {
+		for (int q = 0; q < 4; ++q)
+		{
+			const float energy = sums[q];
+			next.sums[target * 4 + q] = energy;
+			if (energy / total <= threshold || depth + 1 >= MAX_DEPTH || next.nodeCount() >= maxNodes)
+				continue;
+
+			const std::uint32_t child = next.addNode();
+			next.children[target * 4 + q] = child;
+
+			const std::uint32_t sourceChild = source != UINT32_MAX ? recording_.children[source * 4 + q] : 0;
+			if (sourceChild != 0)
+			{
+				const float childSums[4] = { recording_.sums[sourceChild * 4 + 0], recording_.sums[sourceChild * 4 + 1],
+					recording_.sums[sourceChild * 4 + 2], recording_.sums[sourceChild * 4 + 3] };
+				copy(sourceChild, childSums, child, depth + 1);
+			}
+			else
+			{
+				const float childSums[4] = { energy * 0.25f, energy * 0.25f, energy * 0.25f, energy * 0.25f };
+				copy(UINT32_MAX, childSums, child, depth + 1);
+			}
+		}
+		};
+
+	const float rootSums[4] = { root[0], root[1], root[2], root[3] };
+	copy(0, rootSums, 0, 0);
+
+	recording_ = next;
+	std::fill(recording_.sums.begin(), recording_.sums.end(), 0.0f);
+	recording_.total = 0.0f;
+	sampling_ = std::move(next);
+}
+
+void DTree::scaleRecorded(float factor)
+{
+	for (float& s : recording_.sums)
+		s *= factor;
+}
+
+SDTree::SDTree(const math::BBox& bounds, const GuidingSettings& settings) : settings_(settings)
+{
+	// Slightly enlarged so points on the bounds fall inside.
+	const Vector3 size = bounds.size();
+	extent_ = Vector3(std::max(size.x(), 1e-3f), std::max(size.y(), 1e-3f), std::max(size.z(), 1e-3f)) * 1.02f;
+	origin_ = bounds.center() - extent_ * 0.5f;
+
+	nodes_.push_back({ { 0, 0 }, 0, 0 });
+	leaves_.emplace_back();
+}
+
+std::uint32_t SDTree::findLeaf(const Vector3& p) const
+{
+	float local[3];
+	for (int i = 0; i < 3; ++i)
+		local[i] = std::clamp((p[i] - origin_[i]) / extent_[i], 0.0f, 1.0f);
+
+	std::uint32_t node = 0;
+	while (nodes_[node].children[0] != 0)
+	{
+		float& x = local[nodes_[node].axis];
+		const int side = x >= 0.5f;
+		x = x * 2.0f - side;
+		node = nodes_[node].children[side];
+	}
+	return nodes_[node].leaf;
+}
+
+ScatterGuide SDTree::lookup(const Vector3& p) const
+{
+	const DTree& tree = leaves_[findLeaf(p)].tree;
+	if (tree.empty())
+		return ScatterGuide();
+	return { &tree, settings_.bsdfFraction };
+}
+
+void SDTree::record(const Vector3& p, const Vector3& direction, float value)
+{
+	if (!(value > 0.0f) || !std::isfinite(value))
+		return;
+
+	Leaf& leaf = leaves_[findLeaf(p)];
+	leaf.tree.record(direction, value);
+	std::atomic_ref<std::uint32_t>(leaf.samples).fetch_add(1, std::memory_order_relaxed);
+}
+
+size_t SDTree::memoryBytes() const
+{
+	size_t bytes = nodes_.size() * sizeof(Node) + leaves_.size() * sizeof(Leaf);
+	for (const Leaf& leaf : leaves_)
+		bytes += leaf.tree.nodeCount() * NODE_BYTES;
+	return bytes;
+}
+
+void SDTree::refine()
+{
+	const size_t budget = settings_.maxMemoryMB << 20;
+
+	// Split cells that saw enough samples, each half keeps a copy of the
+	// distribution and half of the recorded energy.
+	for (size_t n = 0, count = nodes_.size(); n < count; ++n)
+	{
+		if (nodes_[n].children[0] != 0)
+			continue;
+
+		const std::uint32_t leaf = nodes_[n].leaf;
+		if (leaves_[leaf].samples < std::uint32_t(settings_.spatialThreshold))
+			continue;
+
+		const size_t splitBytes = 2 * sizeof(Node) + sizeof(Leaf) + leaves_[leaf].tree.nodeCount() * NODE_BYTES;
+		if (memoryBytes() + splitBytes > budget)
+			break;
+
+		leaves_[leaf].tree.scaleRecorded(0.5f);
+		leaves_[leaf].samples /= 2;
+		leaves_.push_back(leaves_[leaf]);
+
+		const int axis = (nodes_[n].axis + 1) % 3;
+		const std::uint32_t first = std::uint32_t(nodes_.size());
+		nodes_.push_back({ { 0, 0 }, leaf, axis });
+		nodes_.push_back({ { 0, 0 }, std::uint32_t(leaves_.size() - 1), axis });
+		nodes_[n].children[0] = first;
+		nodes_[n].children[1] = first + 1;
+	}
+
+	// Whatever the spatial tree leaves is shared evenly by the directional
+	// trees, two copies each.
+	const size_t fixed = nodes_.size() * sizeof(Node) + leaves_.size() * sizeof(Leaf);
+	const size_t perTree = budget > fixed ? (budget - fixed) / leaves_.size() / (2 * NODE_BYTES) : 1;
+	for (Leaf& leaf : leaves_)
+	{
+		leaf.tree.build(settings_.directionalThreshold, std::max<size_t>(1, perTree));
+		leaf.samples = 0;
+	}
+	++iterations_;
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include "utils.h"
+#include "vector.h"
+
+#include <cstdint>
+#include <vector>
+
+struct GuidingSettings {
+  // Learn incident radiance while rendering and sample directions from it.
+  // Trained between passes, so only progressive mode uses it.
+  bool enabled = false;
+  // Probability of sampling the BRDF instead of the learned distribution.
+  float bsdfFraction = 0.5f;
+  // Bound on the memory of both trees together.
+  size_t maxMemoryMB = 32;
+  // Samples recorded in a spatial cell before it is split in two.
+  int spatialThreshold = 4000;
+  // Energy fraction above which a directional cell is subdivided.
+  float directionalThreshold = 0.01f;
+};
+
+// Directional quadtree over the cylindrical mapping of the sphere
+// (cos theta, phi), which preserves area, so its density divided by 4 PI
+// is per solid angle. Energy is recorded into one copy while the other,
+// built from the previous iteration, is sampled.
+class DTree {
+public:
+  DTree();
+
+  bool empty() const { return sampling_.total <= 0.0f; }
+  size_t nodeCount() const { return sampling_.nodeCount() + recording_.nodeCount(); }
+
+  // Thread-safe, lock-free.
+  void record(const Vector3 &direction, float value);
+
+  Vector3 sample(float u0, float u1) const;
+  float pdf(const Vector3 &direction) const;
+
+  // Rebuilds the sampling tree from the recorded energy, subdividing cells
+  // above threshold of the total, and clears the recording.
+  void build(float threshold, size_t maxNodes);
+  // Halves the recorded energy after a spatial split.
+  void scaleRecorded(float factor);
+
+private:
+  struct QuadTree {
+    // Energy of the four quadrants of every node and their child nodes,
+    // 0 for leaves.
+    std::vector<float> sums;
+    std::vector<std::uint32_t> children;
+    float total = 0.0f;
+
+    size_t nodeCount() const { return children.size() / 4; }
+    std::uint32_t addNode();
+  };
+
+  QuadTree sampling_;
+  QuadTree recording_;
+};
+
+// Guiding distribution at one shading point.
+struct ScatterGuide {
+  const DTree *tree = nullptr;
+  float bsdfFraction = 1.0f;
+};
+
+// SD-tree: a binary kd-tree over the scene bounds with a DTree per leaf.
+// [Mueller et al. 2017, "Practical Path Guiding for Efficient
+// Light-Transport Simulation"]
+class SDTree {
+public:
+  SDTree(const math::BBox &bounds, const GuidingSettings &settings);
+
+  // Empty guide while the cell has no trained distribution.
+  ScatterGuide lookup(const Vector3 &p) const;
+  // Radiance arriving at p from direction, divided by its sampling pdf.
+  // Thread-safe, lock-free.
+  void record(const Vector3 &p, const Vector3 &direction, float value);
+
+  // Splits busy cells and rebuilds every DTree, between passes only.
+  void refine();
+
+  int iterations() const { return iterations_; }
+  size_t leafCount() const { return leaves_.size(); }
+  size_t memoryBytes() const;
+
+private:
+  struct Node {
+    // Children, 0 for a leaf, then leaf is the index into leaves_.
+    std::uint32_t children[2];
+    std::uint32_t leaf;
+    int axis;
+  };
+
+  struct Leaf {
+    DTree tree;
+    std::uint32_t samples = 0;
+  };
+
+  std::uint32_t findLeaf(const Vector3 &p) const;
+
+  Vector3 origin_;
+  Vector3 extent_;
+  GuidingSettings settings_;
+  std::vector<Node> nodes_;
+  std::vector<Leaf> leaves_;
+  int iterations_ = 0;
+};
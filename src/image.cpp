@@ -0,0 +1,187 @@
+#include "image.h"
+
+#include "concurrency.h"
+#include "timeline.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <string>
+
+float srgb(float x) { return std::pow(x, 1.f / 2.2f); }
+
+Vector3 tonemapping(const Vector3 &color) 
+{
+  return Vector3(std::min(1.0f, color.x()), std::min(1.0f, color.y()),
+                 std::min(1.0f, color.z()));
+}
+
+Vector3 tonemappingUncharted(const Vector3 &color) {
+  const Vector3 A = Vector3(0.15f, 0.15f, 0.15f);
+  const Vector3 B = Vector3(0.50f, 0.50f, 0.50f);
+  const Vector3 C = Vector3(0.10f, 0.10f, 0.10f);
+  const Vector3 D = Vector3(0.20f, 0.20f, 0.20f);
+  const Vector3 E = Vector3(0.02f, 0.02f, 0.02f);
+  const Vector3 F = Vector3(0.30f, 0.30f, 0.30f);
+  const Vector3 wPoint = Vector3(11.20f, 11.30f, 11.20f);
+
+  auto applay = [&](const Vector3 &c) {
+    return ((c * (A * c + C * B) + D * E) / (c * (A * c + B) + D * F)) - E / F;
+  };
+
+  return applay(color) * (Vector3(1.0, 1.0f, 1.0f) / applay(wPoint));
+}
+
+bool saveImageToFile(const char *fileName, std::uint16_t width,
+                     std::uint16_t height, const std::vector<Vector3> &data,
+                     TaskManager *pool) {
+  timeline::Scope scope("save image", fileName);
+  std::ofstream outfile(fileName, std::ios::out | std::ios::binary);
+
+  if (outfile.is_open()) {
+    outfile << "P3\n" << width << " " << height << "\n255\n";
+
+    std::vector<std::string> rows(height);
+    auto format = [&](size_t begin, size_t end) {
+      char pixel[16];
+      for (size_t y = begin; y < end; ++y) {
+        for (int x = 0; x < width; ++x) {
+          Vector3 color = tonemappingUncharted(data[y * width + x]);
+          int r = (int)std::clamp(srgb(color.x()) * 255, 0.0f, 255.0f); // R
+          int g = (int)std::clamp(srgb(color.y()) * 255, 0.0f, 255.0f); // G
+          int b = (int)std::clamp(srgb(color.z()) * 255, 0.0f, 255.0f); // B
+
+          std::snprintf(pixel, sizeof(pixel), "%d %d %d ", r, g, b);
+          rows[y] += pixel;
+        }
+        rows[y] += "\n";
+      }
+    };
+
+    if (pool)
+      parallelFor(*pool, 0, height, 16, format);
+    else
+      format(0, height);
+
+    for (const std::string &row : rows)
+      outfile << row;
+    outfile.close();
+    if (!outfile) {
+      printf("Error: Could not write %s.\n", fileName);
+      return false;
+    }
+
+    // Сообщаем о сохранении
+    printf("Image saved to %s\n", fileName);
+    return true;
+  } else {
+    printf("Error: Could not open %s for writing.\n", fileName);
+    return false;
+  }
+}
+
+void saveLinearImageToFile(const char *fileName, std::uint16_t width,
+                           std::uint16_t height,
+                           const std::vector<Vector3> &data) {
+  timeline::Scope scope("save image", fileName);
+  std::ofstream outfile(fileName, std::ios::out | std::ios::binary);
+
+  if (!outfile.is_open()) {
+    printf("Error: Could not open %s for writing.\n", fileName);
+    return;
+  }
+
+  outfile << "P3\n" << width << " " << height << "\n255\n";
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      const Vector3 &c = data[y * width + x];
+      outfile << (int)std::clamp(c.x() * 255, 0.0f, 255.0f) << " "
+              << (int)std::clamp(c.y() * 255, 0.0f, 255.0f) << " "
+              << (int)std::clamp(c.z() * 255, 0.0f, 255.0f) << " ";
+    }
+    outfile << "\n";
+  }
+
+  printf("Image saved to %s\n", fileName);
+}
+
+void saveHeatmapToFile(const char *fileName, std::uint16_t width,
+                       std::uint16_t height, const std::vector<float> &values,
+                       float maxValue) {
+  timeline::Scope scope("save image", fileName);
+  std::ofstream outfile(fileName, std::ios::out | std::ios::binary);
+
+  if (!outfile.is_open()) {
+    printf("Error: Could not open %s for writing.\n", fileName);
+    return;
+  }
+
+  const float scale = maxValue > 0.0f ? 255.0f / maxValue : 0.0f;
+
+  outfile << "P3\n" << width << " " << height << "\n255\n";
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      const int v = (int)std::clamp(values[y * width + x] * scale, 0.0f, 255.0f);
+      outfile << v << " " << v << " " << v << " ";
+    }
+    outfile << "\n";
+  }
+
+  printf("Image saved to %s\n", fileName);
+}
+
+void saveFalseColorToFile(const char *fileName, std::uint16_t width,
+                          std::uint16_t height,
+                          const std::vector<float> &values, float maxValue) {
+  timeline::Scope scope("save image", fileName);
+  std::ofstream outfile(fileName, std::ios::out | std::ios::binary);
+
+  if (!outfile.is_open()) {
+    printf("Error: Could not open %s for writing.\n", fileName);
+    return;
+  }
+
+  // Piecewise linear ramp through these colours.
+  static const float ramp[][3] = {{0.0f, 0.0f, 0.3f}, {0.0f, 0.2f, 1.0f},
+                                  {0.0f, 0.9f, 0.9f}, {0.1f, 0.9f, 0.1f},
+                                  {1.0f, 0.9f, 0.0f}, {1.0f, 0.0f, 0.0f}};
+  const int segments = int(sizeof(ramp) / sizeof(ramp[0])) - 1;
+  const float scale = maxValue > 0.0f ? 1.0f / maxValue : 0.0f;
+
+  outfile << "P3\n" << width << " " << height << "\n255\n";
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x) {
+      const float t =
+          std::clamp(values[y * width + x] * scale, 0.0f, 1.0f) * segments;
+      const int i = std::min(int(t), segments - 1);
+      const float f = t - float(i);
+      for (int c = 0; c < 3; ++c) {
+        const float v = ramp[i][c] + (ramp[i + 1][c] - ramp[i][c]) * f;
+        outfile << int(v * 255.0f + 0.5f) << " ";
+      }
+    }
+    outfile << "\n";
+  }
+
+  printf("Image saved to %s\n", fileName);
+}
+
+void saveFloatImageToFile(const char *fileName, std::uint16_t width,
+                          std::uint16_t height,
+                          const std::vector<float> &values) {
+  timeline::Scope scope("save image", fileName);
+  std::ofstream outfile(fileName, std::ios::out | std::ios::binary);
+
+  if (!outfile.is_open()) {
+    printf("Error: Could not open %s for writing.\n", fileName);
+    return;
+  }
+
+  // Negative scale marks little endian data, rows go bottom to top.
+  outfile << "Pf\n" << width << " " << height << "\n-1.0\n";
+  for (int y = height - 1; y >= 0; --y)
+    outfile.write(reinterpret_cast<const char *>(&values[size_t(y) * width]),
+                  std::streamsize(width * sizeof(float)));
+
+  printf("Image saved to %s\n", fileName);
+}
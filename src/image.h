@@ -0,0 +1,39 @@
+#pragma once
+
+#include "vector.h"
+
+#include <cstdint>
+#include <vector>
+
+float srgb(float x);
+Vector3 tonemapping(const Vector3 &color);
+Vector3 tonemappingUncharted(const Vector3 &color);
+
+class TaskManager;
+
+// Tonemaps rows in parallel when given a pool. False if the file could not
+// be written.
+bool saveImageToFile(const char *fileName, std::uint16_t width,
+                     std::uint16_t height, const std::vector<Vector3> &data,
+                     TaskManager *pool = nullptr);
+
+// Writes values in [0, 1] as they are, without tonemapping or gamma.
+void saveLinearImageToFile(const char *fileName, std::uint16_t width,
+                           std::uint16_t height,
+                           const std::vector<Vector3> &data);
+
+// Writes scalar values normalised to [0, maxValue] as a grayscale image.
+void saveHeatmapToFile(const char *fileName, std::uint16_t width,
+                       std::uint16_t height, const std::vector<float> &values,
+                       float maxValue);
+
+// Maps values in [0, maxValue] from dark blue over green to red, so small
+// differences in cost stay visible.
+void saveFalseColorToFile(const char *fileName, std::uint16_t width,
+                          std::uint16_t height,
+                          const std::vector<float> &values, float maxValue);
+
+// Writes values unchanged as a single channel little endian PFM.
+void saveFloatImageToFile(const char *fileName, std::uint16_t width,
+                          std::uint16_t height,
+                          const std::vector<float> &values);
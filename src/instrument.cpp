@@ -0,0 +1,126 @@
+#include "instrument.h"
+
+#if PBR_INSTRUMENT
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cstdio>
+
+namespace {
+
+	// One per thread, written only by it. Shards are pushed on a list and
+	// never freed, the same way as the render statistics.
+	struct Shard
+	{
+		std::atomic<std::uint64_t> events[instrument::EVENT_COUNT]{};
+		std::atomic<std::uint64_t> bins[instrument::HISTOGRAM_COUNT][instrument::HISTOGRAM_BINS]{};
+		// Exact sums of the recorded values, for the means.
+		std::atomic<std::uint64_t> sums[instrument::HISTOGRAM_COUNT]{};
+		Shard* next = nullptr;
+	};
+
+	std::atomic<Shard*> shards{ nullptr };
+	thread_local Shard* localShard = nullptr;
+
+	Shard& shard()
+	{
+		if (localShard)
+			return *localShard;
+
+		localShard = new Shard();
+		Shard* head = shards.load(std::memory_order_relaxed);
+		do
+			localShard->next = head;
+		while (!shards.compare_exchange_weak(head, localShard, std::memory_order_release, std::memory_order_relaxed));
+		return *localShard;
+	}
+
+	void bump(std::atomic<std::uint64_t>& counter, std::uint64_t amount)
+	{
+		counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+	}
+
+	void printHistogram(const char* name, const std::uint64_t* bins, std::uint64_t sum)
+	{
+		std::uint64_t total = 0, peak = 0;
+		int last = 0;
+		for (int b = 0; b < instrument::HISTOGRAM_BINS; ++b)
+		{
+			total += bins[b];
+			peak = std::max(peak, bins[b]);
+			if (bins[b])
+				last = b;
+		}
+		printf("  %s: %llu values, mean %.2f\n", name, (unsigned long long)total, total ? double(sum) / total : 0.0);
+		if (!total)
+			return;
+
+		for (int b = 0; b <= last; ++b)
+		{
+			char range[32];
+			if (b == 0)
+				snprintf(range, sizeof(range), "0");
+			else if (b == 1)
+				snprintf(range, sizeof(range), "1");
+			else if (b == instrument::HISTOGRAM_BINS - 1)
+				snprintf(range, sizeof(range), "%u+", 1u << (b - 1));
+			else
+				snprintf(range, sizeof(range), "%u-%u", 1u << (b - 1), (1u << b) - 1);
+
+			const int width = int(40 * bins[b] / peak);
+			printf("    %12s %6.2f%% %.*s\n", range, 100.0 * bins[b] / total, width, "########################################");
+		}
+	}
+}
+
+void instrument::count(Event event, std::uint64_t amount)
+{
+	bump(shard().events[int(event)], amount);
+}
+
+void instrument::record(Histogram histogram, std::uint32_t value)
+{
+	const int bin = std::min(int(std::bit_width(value)), HISTOGRAM_BINS - 1);
+	Shard& s = shard();
+	bump(s.bins[int(histogram)][bin], 1);
+	bump(s.sums[int(histogram)], value);
+}
+
+void instrument::report()
+{
+	std::uint64_t events[EVENT_COUNT] = {};
+	std::uint64_t bins[HISTOGRAM_COUNT][HISTOGRAM_BINS] = {};
+	std::uint64_t sums[HISTOGRAM_COUNT] = {};
+	for (const Shard* s = shards.load(std::memory_order_acquire); s; s = s->next)
+	{
+		for (int e = 0; e < EVENT_COUNT; ++e)
+			events[e] += s->events[e].load(std::memory_order_relaxed);
+		for (int h = 0; h < HISTOGRAM_COUNT; ++h)
+		{
+			for (int b = 0; b < HISTOGRAM_BINS; ++b)
+				bins[h][b] += s->bins[h][b].load(std::memory_order_relaxed);
+			sums[h] += s->sums[h].load(std::memory_order_relaxed);
+		}
+	}
+
+	auto ratio = [](std::uint64_t part, std::uint64_t whole) { return whole ? 100.0 * part / whole : 0.0; };
+
+	printf("Instrumentation:\n");
+	printf("  BVH boxes: %llu tested, %.1f%% hit\n", (unsigned long long)events[int(Event::BoxTests)],
+		ratio(events[int(Event::BoxHits)], events[int(Event::BoxTests)]));
+	printf("  Russian roulette: %.1f%% of %llu vertices killed\n", ratio(events[int(Event::RouletteKills)], events[int(Event::RouletteTests)]),
+		(unsigned long long)events[int(Event::RouletteTests)]);
+	const char* const names[HISTOGRAM_COUNT] = { "nodes per closest hit ray", "triangles per closest hit ray", "nodes per shadow ray",
+		"path depth in bounces" };
+	for (int h = 0; h < HISTOGRAM_COUNT; ++h)
+		printHistogram(names[h], bins[h], sums[h]);
+}
+
+#else
+
+void instrument::count(Event, std::uint64_t) {}
+void instrument::record(Histogram, std::uint32_t) {}
+void instrument::report() {}
+
+#endif
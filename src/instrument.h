@@ -0,0 +1,54 @@
+#pragma once
+
+// Hot-path counters and per-ray histograms for BVH traversal and the path
+// tracer, compiled in with the PBR_INSTRUMENT CMake option. Off, the
+// macros below expand to nothing and the code is the same as without
+// them.
+#if !defined(PBR_INSTRUMENT)
+#define PBR_INSTRUMENT 0
+#endif
+
+#include <cstdint>
+
+namespace instrument {
+
+enum class Event {
+  // BVH node boxes tested and hit, closest hit and shadow rays together.
+  BoxTests,
+  BoxHits,
+  // Path vertices past the minimum depth and the paths ended there.
+  RouletteTests,
+  RouletteKills
+};
+constexpr int EVENT_COUNT = 4;
+
+enum class Histogram {
+  NodesPerRay,
+  TrianglesPerRay,
+  NodesPerShadowRay,
+  // Bounces of a path traced by trace() when it ends.
+  PathDepth
+};
+constexpr int HISTOGRAM_COUNT = 4;
+// Bin 0 holds zero, bin k values in [2^(k-1), 2^k), the last the rest.
+constexpr int HISTOGRAM_BINS = 18;
+
+void count(Event event, std::uint64_t amount);
+void record(Histogram histogram, std::uint32_t value);
+// Prints totals and histograms summed over every thread.
+void report();
+
+} // namespace instrument
+
+#if PBR_INSTRUMENT
+#define PBR_COUNT(event, amount)                                               \
+  ::instrument::count(::instrument::Event::event, amount)
+#define PBR_RECORD(histogram, value)                                           \
+  ::instrument::record(::instrument::Histogram::histogram, value)
+// Statements only needed to gather the counts.
+#define PBR_INSTRUMENT_ONLY(...) __VA_ARGS__
+#else
+#define PBR_COUNT(event, amount) ((void)0)
+#define PBR_RECORD(histogram, value) ((void)0)
+#define PBR_INSTRUMENT_ONLY(...)
+#endif
@@ -0,0 +1,438 @@
+#include "integrator.h"
+
+#include "brdf.h"
+#include "instrument.h"
+#include "stats.h"
+#include "utils.h"
+
+#include <array>
+#include <utility>
+
+Vector3 randomUniformVectorHemispher() 
+{
+  const float phi = randFloat(0, 1) * 2.0f * PI;
+  const float cosTheta = randFloat(0, 1) * 2.0f - 1.0f;
+  const float sinTheta = std::sqrt(1 - cosTheta * cosTheta);
+  const float x = std::cos(phi) * sinTheta;
+  const float y = cosTheta;
+  const float z = std::sin(phi) * sinTheta;
+  return Vector3(x, y, z);
+}
+
+Vector3 randOnHemispher(const Vector3 &normal) 
+{
+  Vector3 onSphere = randUnitVector();
+  if (dot(onSphere, normal) > 0.0f)
+    return onSphere;
+  else
+    return -onSphere;
+}
+
+Vector3 reflect(const Vector3 &d, const Vector3 &n) 
+{
+  return d - 2.0f * dot(d, n) * n;
+}
+
+float powerHeuristic(float pdfA, float pdfB)
+{
+  const float a = pdfA * pdfA;
+  const float b = pdfB * pdfB;
+  return a + b > 0.0f ? a / (a + b) : 0.0f;
+}
+
+Vector3 interpolatedNormal(const math::Triangle &tr, const Vector3 &p)
+{
+  // Calculate barycentric coordinates for normal interpolation
+  const Vector3 v0 = tr.b - tr.a;
+  const Vector3 v1 = tr.c - tr.a;
+  const Vector3 v2 = p - tr.a;
+
+  const float d00 = dot(v0, v0);
+  const float d01 = dot(v0, v1);
+  const float d11 = dot(v1, v1);
+  const float d20 = dot(v2, v0);
+  const float d21 = dot(v2, v1);
+
+  const float denom = d00 * d11 - d01 * d01;
+  if (std::abs(denom) < 1e-8f)
+    return unit_vector(cross(v0, v1));
+
+  const float v = (d11 * d20 - d01 * d21) / denom;
+  const float w = (d00 * d21 - d01 * d20) / denom;
+  const float u = 1.0f - v - w;
+
+  return unit_vector(u * tr.na + v * tr.nb + w * tr.nc);
+}
+
+float environmentSelectProbability(const Scene &scene)
+{
+  if (scene.environment().empty())
+    return 0.0f;
+  return scene.lights().empty() ? 1.0f : 0.5f;
+}
+
+float environmentPdf(const Scene &scene, const Vector3 &direction)
+{
+  return environmentSelectProbability(scene) *
+         scene.environment().pdf(direction);
+}
+
+float emitterPdf(const Scene &scene, const math::Triangle &tr,
+                 const math::Ray &ray, float t)
+{
+  const Vector3 n = cross(tr.b - tr.a, tr.c - tr.a);
+  const float cosLight = std::abs(dot(unit_vector(n), ray.direction));
+  if (cosLight <= 0.0f)
+    return 0.0f;
+  return (1.0f - environmentSelectProbability(scene)) *
+         scene.lights().pdfArea(ray.origin, tr.lightIndex) * t * t / cosLight;
+}
+
+Vector3 evalScatter(const ShadingRecord &s, const Vector3 &N, const Vector3 &V,
+                    const Vector3 &L)
+{
+  const float cosTheta = dot(L, N);
+  if (cosTheta <= 0.0f)
+    return Vector3();
+  const Vector3 H = unit_vector((L + V) * 0.5f);
+  return BRDF(s, L, H, N, V) * cosTheta;
+}
+
+float scatterPdf(const ShadingRecord &s, const Vector3 &N, const Vector3 &V,
+                 const Vector3 &L, const ScatterGuide &guide)
+{
+  const float brdf = pdfBRDF(s, N, V, L);
+  if (!guide.tree)
+    return brdf;
+  return guide.bsdfFraction * brdf +
+         (1.0f - guide.bsdfFraction) * guide.tree->pdf(L);
+}
+
+ScatterSample sampleScatter(const ShadingRecord &s, const Vector3 &N,
+                            const Vector3 &V, const ScatterGuide &guide)
+{
+  Vector3 newDir;
+  if (guide.tree && randomFloat() >= guide.bsdfFraction)
+    newDir = guide.tree->sample(randomFloat(), randomFloat());
+  else
+    newDir = sampleBRDF(s, N, V, randomFloat(), randomFloat(), randomFloat());
+
+  ScatterSample out;
+  out.direction = newDir;
+  out.pdf = scatterPdf(s, N, V, newDir, guide);
+  out.weight =
+      out.pdf > 0.0f ? evalScatter(s, N, V, newDir) / out.pdf : Vector3();
+  return out;
+}
+
+bool connectLight(const Scene &scene, const Vector3 &p, const Vector3 &N,
+                  LightConnection &out)
+{
+  const float environmentProbability = environmentSelectProbability(scene);
+  if (environmentProbability > 0.0f && randomFloat() < environmentProbability)
+  {
+    const EnvironmentSample env =
+        scene.environment().sample(randomFloat(), randomFloat());
+    if (env.pdf <= 0.0f || dot(env.direction, N) <= 0.0f)
+      return false;
+
+    out.shadowRay = math::Ray({p, env.direction});
+    out.distance = RAY_T_MAX;
+    out.emission = env.radiance;
+    out.pdf = environmentProbability * env.pdf;
+    return true;
+  }
+
+  if (scene.lights().empty())
+    return false;
+
+  const LightSample light =
+      scene.lights().sample(p, randomFloat(), randomFloat(), randomFloat());
+
+  const Vector3 toLight = light.position - p;
+  const float dist2 = toLight.length_squared();
+  const float dist = std::sqrt(dist2);
+  const Vector3 L = toLight / dist;
+
+  const float cosLight = std::abs(dot(light.normal, L));
+  if (light.pdfArea <= 0.0f || cosLight <= 0.0f || dot(L, N) <= 0.0f)
+    return false;
+
+  out.shadowRay = math::Ray({p, L});
+  out.distance = dist;
+  out.emission = light.emission;
+  out.pdf = (1.0f - environmentProbability) * light.pdfArea * dist2 / cosLight;
+  return true;
+}
+
+bool sampleDirect(const Scene &scene, const ShadingRecord &s, const Vector3 &p,
+                  const Vector3 &N, const Vector3 &V, DirectSample &out,
+                  const ScatterGuide &guide)
+{
+  LightConnection light;
+  if (!connectLight(scene, p, N, light))
+    return false;
+
+  const Vector3 &L = light.shadowRay.direction;
+  const Vector3 f = evalScatter(s, N, V, L);
+  const float weight = powerHeuristic(light.pdf, scatterPdf(s, N, V, L, guide));
+
+  out.shadowRay = light.shadowRay;
+  out.distance = light.distance;
+  out.contribution = f * light.emission * (weight / light.pdf);
+  return true;
+}
+
+namespace
+{
+template <bool NEE, bool Guiding, bool Cache, bool Environment>
+Vector3 traceVariant(const math::Ray &ray, const Scene &scene,
+                     const IntegratorSettings &settings, int depth,
+                     float lastPdf)
+{
+  const float tMin = RAY_T_MIN;
+  float tMax = RAY_T_MAX;
+
+  addStat(depth == 0 ? Stat::PrimaryRays : Stat::SecondaryRays);
+  math::Triangle tr;
+  float t = scene.intersect(ray, tMin, tMax, tr);
+  if (t >= tMax)
+  {
+    PBR_RECORD(PathDepth, std::uint32_t(depth));
+    if constexpr (!Environment)
+      return Vector3();
+
+    const Vector3 background = scene.environment().eval(ray.direction);
+    if (NEE && depth > 0)
+      return background *
+             powerHeuristic(lastPdf, environmentPdf(scene, ray.direction));
+    return background;
+  }
+
+  tMax = t;
+  const Vector3 hitPoint = ray.origin + ray.direction * tMax;
+  Vector3 hitNormal = interpolatedNormal(tr, hitPoint);
+
+  if (dot(hitNormal, ray.direction) > 0.0)
+    hitNormal = -hitNormal;
+
+  const MaterialRecord &m = scene.materialTable()[tr.matIndex];
+
+  // Emitters found by BRDF sampling share their weight with the light
+  // sample taken at the previous vertex.
+  Vector3 color = m.emission;
+  if (NEE && depth > 0 && m.emissive)
+    color = color * powerHeuristic(lastPdf, emitterPdf(scene, tr, ray, tMax));
+
+  if (m.black)
+  {
+    PBR_RECORD(PathDepth, std::uint32_t(depth));
+    return color;
+  }
+
+  // Deep enough paths stop at a trained cache cell, keeping the emission
+  // of this vertex.
+  Vector3 cached;
+  if (Cache && depth >= settings.cache->terminateDepth() &&
+      settings.cache->lookup(hitPoint, hitNormal, tMax, cached))
+  {
+    PBR_RECORD(PathDepth, std::uint32_t(depth));
+    return color + cached;
+  }
+
+  // float probToContinue = 0.5;// std::min(0.9f, std::max( 1e-3f, std::max(
+  // m.albedo.x(), std::max( m.albedo.y(), m.albedo.z() ) )));
+  const float probToContinue = m.continueProbability;
+  if (depth > settings.maxDepth)
+  {
+    PBR_COUNT(RouletteTests, 1);
+    if (randFloat(0, 1) > probToContinue)
+    {
+      PBR_COUNT(RouletteKills, 1);
+      PBR_RECORD(PathDepth, std::uint32_t(depth));
+      return color;
+    }
+  }
+
+  const Vector3 V = ray.direction * -1.0f;
+  const Vector3 N = hitNormal;
+  const ShadingRecord &shading = scene.shadingTable()[tr.matIndex];
+  ScatterGuide guide;
+  if constexpr (Guiding)
+    guide = settings.guide->lookup(hitPoint);
+
+  Vector3 indirect;
+
+  DirectSample direct;
+  if (NEE && sampleDirect(scene, shading, hitPoint, N, V, direct, guide))
+  {
+    addStat(Stat::ShadowRays);
+    if (!scene.occluded(direct.shadowRay, tMin, direct.distance - tMin))
+      indirect += direct.contribution;
+  }
+
+  const ScatterSample s = sampleScatter(shading, N, V, guide);
+  const Vector3 newOrig = hitPoint + s.direction * 1e-4f;
+  const math::Ray newRay({newOrig, s.direction});
+
+  const Vector3 incoming = traceVariant<NEE, Guiding, Cache, Environment>(
+      newRay, scene, settings, depth + 1, s.pdf);
+  if (Guiding && s.pdf > 0.0f)
+    settings.guide->record(hitPoint, s.direction,
+                           math::luminance(incoming) / s.pdf);
+  indirect += incoming * s.weight;
+
+  if (depth > settings.maxDepth)
+    indirect = indirect * (1.0f / probToContinue);
+
+  if constexpr (Cache)
+    settings.cache->record(hitPoint, N, tMax, indirect);
+
+  return color + indirect;
+}
+
+template <size_t... Index>
+constexpr std::array<IntegratorVariant, sizeof...(Index)>
+makeVariants(std::index_sequence<Index...>)
+{
+  return {{{Index, traceVariant<(Index & INTEGRATOR_NEE) != 0,
+                                (Index & INTEGRATOR_GUIDING) != 0,
+                                (Index & INTEGRATOR_CACHE) != 0,
+                                (Index & INTEGRATOR_ENVIRONMENT) != 0>}...}};
+}
+
+constexpr auto VARIANTS =
+    makeVariants(std::make_index_sequence<INTEGRATOR_VARIANT_COUNT>());
+} // namespace
+
+const IntegratorVariant *integratorVariants() { return VARIANTS.data(); }
+
+const IntegratorVariant &selectIntegrator(const Scene &scene,
+                                          const IntegratorSettings &settings)
+{
+  const bool environment = !scene.environment().empty();
+  // Without anything to sample, light sampling only costs time.
+  const bool nee = settings.nee && (environment || !scene.lights().empty());
+
+  unsigned features = 0;
+  if (nee)
+    features |= INTEGRATOR_NEE;
+  if (settings.guide)
+    features |= INTEGRATOR_GUIDING;
+  if (settings.cache)
+    features |= INTEGRATOR_CACHE;
+  if (environment)
+    features |= INTEGRATOR_ENVIRONMENT;
+  return VARIANTS[features];
+}
+
+std::string integratorVariantName(unsigned features)
+{
+  static const char *const names[] = {"nee", "guiding", "cache", "environment"};
+  std::string name;
+  for (unsigned bit = 0; bit < 4; ++bit)
+  {
+    if (!(features & (1u << bit)))
+      continue;
+    if (!name.empty())
+      name += '+';
+    name += names[bit];
+  }
+  return name.empty() ? "plain" : name;
+}
+
+Vector3 trace(const math::Ray &ray, const Scene &scene,
+              const IntegratorSettings &settings, int depth, float lastPdf)
+{
+  return selectIntegrator(scene, settings)
+      .trace(ray, scene, settings, depth, lastPdf);
+}
+
+// Vector3 trace_iterative( math::Ray ray, const Scene& scene, int maxDepth)
+//{
+//	Vector3 throughput = Vector3(1.0, 1.0, 1.0);
+//	Vector3 radiance = Vector3(0.0, 0.0, 0.0);
+//
+//	const float tMin = 0.001f;
+//
+//	for (int depth = 0; depth < maxDepth; ++depth)
+//	{
+//		float tMax = 10000.0f;
+//		float t;
+//		Vector3 hitNormal;
+//		int matIndex = -1;
+//
+//
+//		for (const auto& sp : scene.spheres())
+//		{
+//			t = math::intersect(ray, sp, tMin, tMax);
+//			if (t < tMax)
+//			{
+//				Vector3 pos = ray.origin + ray.direction * t;
+//				hitNormal = unit_vector(pos - sp.pos);
+//				tMax = t;
+//				matIndex = sp.matIndex;
+//			}
+//		}
+//
+//		for (const auto& p : scene.planes())
+//		{
+//			t = intersectPlane2(ray, p.normal, p.dist, tMin, tMax);
+//			if (t < tMax)
+//			{
+//				hitNormal = p.normal;
+//				tMax = t;
+//				matIndex = p.matIndex;
+//			}
+//		}
+//
+//		for (const auto& tr : scene.triangles())
+//		{
+//			t = math::intersect(ray, tr, tMin, tMax);
+//			if (t < tMax)
+//			{
+//				hitNormal = unit_vector(cross(tr.b - tr.a, tr.c
+//- tr.a)); 				tMax = t;
+//matIndex = tr.matIndex;
+//			}
+//		}
+//
+//		if (matIndex == -1 || tMax == 10000.0f) // matIndex == -1 -
+// более явная проверка на промах
+//		{
+//			radiance += throughput * scene.enviroment();
+//			break;
+//		}
+//
+//		if (dot(hitNormal, ray.direction) > 0.0)
+//			hitNormal = -hitNormal;
+//
+//
+//		Vector3 newDir = randomUniformVectorHemispher();
+//
+//		auto cosTheta = dot(newDir, hitNormal);
+//		if (cosTheta < 0.0)
+//			newDir *= -1;
+//
+//		cosTheta = dot(newDir, hitNormal);
+//
+//		const Material m = scene.materials()[matIndex];
+//
+//
+//		radiance += throughput * m.emission;
+//
+//		const float brdf = 1.0f / PI;
+//		const float pdf = 1.0f / (2.0f * PI);
+//
+//		throughput = throughput * m.albedo * (brdf * cosTheta / pdf);
+//
+//
+//		const Vector3 newOrig = ray.origin + ray.direction * tMax +
+// newDir * 1e-4f;
+//
+//		ray.origin = newOrig;
+//		ray.direction = newDir;
+//	}
+//
+//	return radiance;
+// }
@@ -0,0 +1,116 @@
+#pragma once
+
+#include "brdf.h"
+#include "guiding.h"
+#include "radiancecache.h"
+#include "scene.h"
+#include "utils.h"
+#include "vector.h"
+
+#include <string>
+
+constexpr float RAY_T_MIN = 0.1f;
+// Rays that hit nothing closer leave the scene.
+constexpr float RAY_T_MAX = 10000.0f;
+
+struct IntegratorSettings {
+  // Next event estimation: sample emitters directly at every vertex and
+  // combine with BRDF sampling by multiple importance sampling.
+  bool nee = true;
+  // Russian roulette starts after this many bounces.
+  int maxDepth = 10;
+  // Path guiding distribution, trained by the renderer; null disables it.
+  SDTree *guide = nullptr;
+  // Reflected radiance cache paths terminate into, owned by the renderer;
+  // null disables it.
+  RadianceCache *cache = nullptr;
+};
+
+struct ScatterSample {
+  Vector3 direction;
+  // BRDF * cos / pdf
+  Vector3 weight;
+  float pdf;
+};
+
+// Light sample seen from a shading point, before the BRDF is applied.
+struct LightConnection {
+  math::Ray shadowRay;
+  float distance;
+  Vector3 emission;
+  // Solid angle density of the light sample.
+  float pdf;
+};
+
+struct DirectSample {
+  math::Ray shadowRay;
+  float distance;
+  // Unoccluded contribution, already divided by the pdf and MIS weighted.
+  Vector3 contribution;
+};
+
+Vector3 randomUniformVectorHemispher();
+Vector3 randOnHemispher(const Vector3 &normal);
+Vector3 reflect(const Vector3 &d, const Vector3 &n);
+
+float powerHeuristic(float pdfA, float pdfB);
+Vector3 interpolatedNormal(const math::Triangle &tr, const Vector3 &p);
+
+// Chance that light sampling picks the environment over the emitters.
+float environmentSelectProbability(const Scene &scene);
+// Solid angle density of sampling this direction from the environment.
+float environmentPdf(const Scene &scene, const Vector3 &direction);
+// Solid angle density of reaching this emitter point by light sampling.
+float emitterPdf(const Scene &scene, const math::Triangle &tr,
+                 const math::Ray &ray, float t);
+
+Vector3 evalScatter(const ShadingRecord &s, const Vector3 &N, const Vector3 &V,
+                    const Vector3 &L);
+// BRDF importance sampling, see sampleBRDF, mixed with the guiding
+// distribution when one is given.
+float scatterPdf(const ShadingRecord &s, const Vector3 &N, const Vector3 &V,
+                 const Vector3 &L, const ScatterGuide &guide = ScatterGuide());
+ScatterSample sampleScatter(const ShadingRecord &s, const Vector3 &N,
+                            const Vector3 &V,
+                            const ScatterGuide &guide = ScatterGuide());
+
+// Picks a point on an emitter or a direction of the environment facing p. Batched callers evaluate the BRDF
+// for the connection themselves, sampleDirect does it in place.
+bool connectLight(const Scene &scene, const Vector3 &p, const Vector3 &N,
+                  LightConnection &out);
+bool sampleDirect(const Scene &scene, const ShadingRecord &s, const Vector3 &p,
+                  const Vector3 &N, const Vector3 &V, DirectSample &out,
+                  const ScatterGuide &guide = ScatterGuide());
+
+// Features a path tracer variant is compiled with. Each of the
+// INTEGRATOR_VARIANT_COUNT combinations is its own instantiation, so a
+// variant has no branches or lookups for the features it lacks.
+enum IntegratorFeature : unsigned {
+  INTEGRATOR_NEE = 1,
+  INTEGRATOR_GUIDING = 2,
+  INTEGRATOR_CACHE = 4,
+  INTEGRATOR_ENVIRONMENT = 8,
+};
+constexpr unsigned INTEGRATOR_VARIANT_COUNT = 16;
+
+using TraceFunction = Vector3 (*)(const math::Ray &ray, const Scene &scene,
+                                  const IntegratorSettings &settings,
+                                  int depth, float lastPdf);
+
+struct IntegratorVariant {
+  unsigned features;
+  TraceFunction trace;
+};
+
+// Dispatch table of INTEGRATOR_VARIANT_COUNT entries indexed by features.
+const IntegratorVariant *integratorVariants();
+// Variant with only the features the settings ask for and the scene can
+// use; light sampling is dropped when there is nothing to sample.
+const IntegratorVariant &selectIntegrator(const Scene &scene,
+                                          const IntegratorSettings &settings);
+std::string integratorVariantName(unsigned features);
+
+// Runs the selected variant.
+Vector3 trace(const math::Ray &ray, const Scene &scene,
+              const IntegratorSettings &settings, int depth = 0,
+              float lastPdf = 0.0f);
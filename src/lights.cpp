@@ -0,0 +1,233 @@
+#include "lights.h"
+
+#include "scene.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+	Vector3 centroid(const Vector3& a, const Vector3& e1, const Vector3& e2)
+	{
+		return a + (e1 + e2) * (1.0f / 3.0f);
+	}
+
+	// Smallest cone around both cones, as axis and half angle.
+	void mergeCones(Vector3& axis, float& theta, const Vector3& otherAxis, float otherTheta)
+	{
+		Vector3 a = axis, b = otherAxis;
+		float ta = theta, tb = otherTheta;
+		if (ta < tb)
+		{
+			std::swap(a, b);
+			std::swap(ta, tb);
+		}
+
+		const float td = std::acos(std::clamp(dot(a, b), -1.0f, 1.0f));
+		if (std::min(td + tb, PI) <= ta)
+		{
+			axis = a;
+			theta = ta;
+			return;
+		}
+
+		const float to = 0.5f * (ta + td + tb);
+		const Vector3 perpendicular = b - a * dot(a, b);
+		if (to >= PI || perpendicular.length_squared() <= 1e-12f)
+		{
+			axis = a;
+			theta = PI;
+			return;
+		}
+
+		// Rotate a towards b so the new cone touches both far edges.
+		const float tr = to - ta;
+		axis = unit_vector(a * std::cos(tr) + unit_vector(perpendicular) * std::sin(tr));
+		theta = to;
+	}
+}
+
+void LightSampler::build(const std::vector<math::Triangle>& triangles, const std::vector<Material>& materials)
+{
+	lights_.clear();
+	nodes_.clear();
+
+	for (const auto& t : triangles)
+	{
+		if (t.lightIndex < 0)
+			continue;
+
+		const Vector3 e1 = t.b - t.a;
+		const Vector3 e2 = t.c - t.a;
+		const Vector3 n = cross(e1, e2);
+		const float area = 0.5f * n.length();
+
+		if (size_t(t.lightIndex) >= lights_.size())
+			lights_.resize(t.lightIndex + 1);
+		lights_[t.lightIndex] = { t.a, e1, e2, area > 0.0f ? unit_vector(n) : Vector3(0.0f, 1.0f, 0.0f), materials[t.matIndex].emission, area, 0 };
+	}
+
+	if (lights_.empty())
+		return;
+
+	std::vector<std::int32_t> order(lights_.size());
+	for (size_t i = 0; i < order.size(); ++i)
+		order[i] = std::int32_t(i);
+
+	nodes_.reserve(2 * lights_.size() - 1);
+	buildNode(order, 0, order.size(), 0, 0);
+}
+
+std::int32_t LightSampler::buildNode(std::vector<std::int32_t>& order, size_t begin, size_t end, std::uint32_t trail, int depth)
+{
+	const std::int32_t index = std::int32_t(nodes_.size());
+	nodes_.push_back({});
+
+	if (end - begin == 1)
+	{
+		Light& light = lights_[order[begin]];
+		light.trail = trail;
+
+		Node& leaf = nodes_[index];
+		leaf.bounds.growTo(light.a);
+		leaf.bounds.growTo(light.a + light.e1);
+		leaf.bounds.growTo(light.a + light.e2);
+		leaf.axis = light.normal;
+		leaf.theta = 0.0f;
+		leaf.power = light.area * math::luminance(light.emission);
+		leaf.left = -1;
+		leaf.right = order[begin];
+		return index;
+	}
+
+	// Median split along the widest extent of the centroids keeps the tree
+	// balanced, so trails fit 32 bits.
+	math::BBox centroids;
+	for (size_t i = begin; i < end; ++i)
+	{
+		const Light& l = lights_[order[i]];
+		centroids.growTo(centroid(l.a, l.e1, l.e2));
+	}
+	const Vector3 extent = centroids.size();
+	const int axis = extent.x() > extent.y() ? (extent.x() > extent.z() ? 0 : 2) : (extent.y() > extent.z() ? 1 : 2);
+
+	const size_t mid = (begin + end) / 2;
+	std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end, [&](std::int32_t a, std::int32_t b) {
+		const Light& la = lights_[a];
+		const Light& lb = lights_[b];
+		return centroid(la.a, la.e1, la.e2)[axis] < centroid(lb.a, lb.e1, lb.e2)[axis];
+		});
+
+	const std::int32_t left = buildNode(order, begin, mid, trail, depth + 1);
+	const std::int32_t right = buildNode(order, mid, end, trail | (1u << depth), depth + 1);
+
+	const Node& l = nodes_[left];
+	const Node& r = nodes_[right];
+	Node node;
+	node.bounds = l.bounds;
+	node.bounds.growTo(r.bounds.min());
+	node.bounds.growTo(r.bounds.max());
+	node.axis = l.axis;
+	node.theta = l.theta;
+	mergeCones(node.axis, node.theta, r.axis, r.theta);
+	node.power = l.power + r.power;
+	node.left = left;
+	node.right = right;
+	nodes_[index] = node;
+	return index;
+}
+
+float LightSampler::importance(const Node& node, const Vector3& p) const
+{
+	if (node.power <= 0.0f)
+		return 0.0f;
+
+	const Vector3 toPoint = p - node.bounds.center();
+	const float dist2 = toPoint.length_squared();
+	const float radius = 0.5f * node.bounds.size().length();
+	if (dist2 <= radius * radius)
+		return node.power / std::max(dist2, 0.25f * radius * radius);
+
+	// Emitters are two-sided, so the angle is taken to the nearer of axis
+	// and -axis. The bounds widen it by their angular radius.
+	const float dist = std::sqrt(dist2);
+	const float cosTheta = dot(node.axis, toPoint) / dist;
+	const float theta = std::acos(std::min(1.0f, std::abs(cosTheta)));
+	const float thetaBounds = std::asin(std::min(1.0f, radius / dist));
+	const float thetaPrime = std::max(0.0f, theta - node.theta - thetaBounds);
+	if (thetaPrime >= 0.5f * PI)
+		return 0.0f;
+
+	return node.power * std::cos(thetaPrime) / dist2;
+}
+
+float LightSampler::leftProbability(const Node& node, const Vector3& p) const
+{
+	const float left = importance(nodes_[node.left], p);
+	const float right = importance(nodes_[node.right], p);
+	return left + right > 0.0f ? left / (left + right) : 0.5f;
+}
+
+LightSample LightSampler::sample(const Vector3& p, float u0, float u1, float u2) const
+{
+	// Descend with u0 rescaled to the chosen side at every level.
+	float probability = 1.0f;
+	const Node* node = &nodes_[0];
+	while (node->left >= 0)
+	{
+		const float pl = leftProbability(*node, p);
+		if (u0 < pl)
+		{
+			u0 = std::min(u0 / pl, 0.99999994f);
+			probability *= pl;
+			node = &nodes_[node->left];
+		}
+		else
+		{
+			u0 = std::min((u0 - pl) / (1.0f - pl), 0.99999994f);
+			probability *= 1.0f - pl;
+			node = &nodes_[node->right];
+		}
+	}
+	const Light& light = lights_[node->right];
+
+	// Uniform point on the triangle
+	const float su = std::sqrt(u1);
+	const float b1 = 1.0f - su;
+	const float b2 = u2 * su;
+
+	LightSample s;
+	s.position = light.a + b1 * light.e1 + b2 * light.e2;
+	s.normal = light.normal;
+	s.emission = light.emission;
+	s.pdfArea = light.area > 0.0f ? probability / light.area : 0.0f;
+	return s;
+}
+
+float LightSampler::pdfArea(const Vector3& p, std::int32_t lightIndex) const
+{
+	if (lightIndex < 0 || size_t(lightIndex) >= lights_.size())
+		return 0.0f;
+
+	const Light& light = lights_[lightIndex];
+	if (light.area <= 0.0f)
+		return 0.0f;
+
+	float probability = 1.0f;
+	const Node* node = &nodes_[0];
+	for (int depth = 0; node->left >= 0; ++depth)
+	{
+		const float pl = leftProbability(*node, p);
+		if ((light.trail >> depth) & 1u)
+		{
+			probability *= 1.0f - pl;
+			node = &nodes_[node->right];
+		}
+		else
+		{
+			probability *= pl;
+			node = &nodes_[node->left];
+		}
+	}
+	return probability / light.area;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "utils.h"
+#include "vector.h"
+
+#include <cstdint>
+#include <vector>
+
+struct Material;
+
+struct LightSample {
+  Vector3 position;
+  Vector3 normal;
+  Vector3 emission;
+  // Probability density per unit area, including the choice of the light.
+  float pdfArea;
+};
+
+// Emissive triangles in a binary hierarchy of bounds, normal cones and
+// power. Sampling descends from the root, choosing children by their
+// estimated contribution at the shading point.
+// [Conty Estevez and Kulla 2018, "Importance Sampling of Many Lights with
+// Adaptive Tree Splitting"]
+class LightSampler {
+public:
+  // Lights are the triangles with a lightIndex, numbered 0, 1, ...
+  void build(const std::vector<math::Triangle> &triangles,
+             const std::vector<Material> &materials);
+
+  bool empty() const { return lights_.empty(); }
+  size_t size() const { return lights_.size(); }
+
+  LightSample sample(const Vector3 &p, float u0, float u1, float u2) const;
+
+  // Area density of sampling a point on this light from p.
+  float pdfArea(const Vector3 &p, std::int32_t lightIndex) const;
+
+private:
+  struct Light {
+    Vector3 a;
+    Vector3 e1;
+    Vector3 e2;
+    Vector3 normal;
+    Vector3 emission;
+    float area;
+    // Child choices from the root, bit d set for the right child at depth d.
+    std::uint32_t trail;
+  };
+
+  struct Node {
+    math::BBox bounds;
+    Vector3 axis;
+    // Normals lie within this angle of axis.
+    float theta;
+    float power;
+    // Children of an inner node, or -1 and the light of a leaf.
+    std::int32_t left;
+    std::int32_t right;
+  };
+
+  std::int32_t buildNode(std::vector<std::int32_t> &order, size_t begin,
+                         size_t end, std::uint32_t trail, int depth);
+  float importance(const Node &node, const Vector3 &p) const;
+  // Probability of descending to the left child of an inner node.
+  float leftProbability(const Node &node, const Vector3 &p) const;
+
+  std::vector<Light> lights_;
+  std::vector<Node> nodes_;
+};
@@ -0,0 +1,131 @@
+#include "radiancecache.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+	constexpr int PROBE_LENGTH = 8;
+	constexpr int MAX_LEVEL = 15;
+	constexpr int AXIS_BITS = 17;
+	constexpr std::int64_t AXIS_CELLS = std::int64_t(1) << AXIS_BITS;
+	// Rays longer than this many finest cells land on coarser levels.
+	constexpr float LEVEL_DISTANCE = 32.0f;
+
+	std::uint64_t mix(std::uint64_t x)
+	{
+		x ^= x >> 33;
+		x *= 0xff51afd7ed558ccdull;
+		x ^= x >> 33;
+		x *= 0xc4ceb9fe1a85ec53ull;
+		x ^= x >> 33;
+		return x;
+	}
+
+	int normalBin(const Vector3& N)
+	{
+		const float ax = std::abs(N.x());
+		const float ay = std::abs(N.y());
+		const float az = std::abs(N.z());
+		if (ax >= ay && ax >= az)
+			return N.x() < 0.0f;
+		if (ay >= az)
+			return 2 + (N.y() < 0.0f);
+		return 4 + (N.z() < 0.0f);
+	}
+}
+
+RadianceCache::RadianceCache(const math::BBox& bounds, const RadianceCacheSettings& settings) : settings_(settings)
+{
+	const float diagonal = std::max(bounds.size().length(), 1e-3f);
+	cellSize_ = std::max(diagonal * settings_.cellScale, 1e-6f);
+	// Cells are counted from a margin below the bounds so points on them
+	// have positive coordinates.
+	origin_ = bounds.min() - Vector3(1.0f, 1.0f, 1.0f) * cellSize_;
+
+	const size_t budget = std::max<size_t>(settings_.maxMemoryMB, 1) << 20;
+	capacity_ = 1;
+	while (capacity_ * 2 * sizeof(Entry) <= budget)
+		capacity_ *= 2;
+	entries_.reset(new Entry[capacity_]);
+}
+
+std::uint64_t RadianceCache::key(const Vector3& p, const Vector3& N, float distance) const
+{
+	const int level = std::clamp(int(std::log2(1.0f + distance / (cellSize_ * LEVEL_DISTANCE))), 0, MAX_LEVEL);
+	const float size = std::ldexp(cellSize_, level);
+
+	std::uint64_t k = std::uint64_t(level) << 3 | std::uint64_t(normalBin(N));
+	for (int i = 0; i < 3; ++i)
+	{
+		const std::int64_t cell = std::clamp<std::int64_t>(std::int64_t((p[i] - origin_[i]) / size), 0, AXIS_CELLS - 1);
+		k = k << AXIS_BITS | std::uint64_t(cell);
+	}
+	// Top bit keeps every key distinct from a free slot.
+	return k | (std::uint64_t(1) << 63);
+}
+
+RadianceCache::Entry* RadianceCache::find(std::uint64_t key, bool insert) const
+{
+	const size_t mask = capacity_ - 1;
+	size_t slot = size_t(mix(key)) & mask;
+	for (int i = 0; i < PROBE_LENGTH; ++i, slot = (slot + 1) & mask)
+	{
+		Entry& entry = entries_[slot];
+		std::uint64_t current = entry.key.load(std::memory_order_acquire);
+		if (current == key)
+			return &entry;
+		if (current != 0 || !insert)
+			continue;
+
+		// Claim the free slot, unless another thread got it first for the
+		// same cell.
+		if (entry.key.compare_exchange_strong(current, key, std::memory_order_acq_rel) || current == key)
+			return &entry;
+	}
+	return nullptr;
+}
+
+bool RadianceCache::lookup(const Vector3& p, const Vector3& N, float distance, Vector3& radiance) const
+{
+	addStat(Stat::CacheLookups);
+	const Entry* entry = find(key(p, N, distance), false);
+	if (!entry)
+		return false;
+
+	const std::uint32_t count = entry->count.load(std::memory_order_relaxed);
+	if (count < std::uint32_t(settings_.minSamples))
+		return false;
+
+	const float scale = 1.0f / count;
+	radiance = Vector3(entry->sum[0].load(std::memory_order_relaxed), entry->sum[1].load(std::memory_order_relaxed),
+		entry->sum[2].load(std::memory_order_relaxed)) * scale;
+	addStat(Stat::CacheHits);
+	return true;
+}
+
+void RadianceCache::record(const Vector3& p, const Vector3& N, float distance, const Vector3& radiance)
+{
+	if (!std::isfinite(radiance.x()) || !std::isfinite(radiance.y()) || !std::isfinite(radiance.z()))
+		return;
+
+	Entry* entry = find(key(p, N, distance), true);
+	if (!entry)
+	{
+		dropped_.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	for (int i = 0; i < 3; ++i)
+		entry->sum[i].fetch_add(radiance[i], std::memory_order_relaxed);
+	entry->count.fetch_add(1, std::memory_order_relaxed);
+}
+
+size_t RadianceCache::usedEntries() const
+{
+	size_t used = 0;
+	for (size_t i = 0; i < capacity_; ++i)
+		used += entries_[i].key.load(std::memory_order_relaxed) != 0;
+	return used;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "utils.h"
+#include "vector.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+struct RadianceCacheSettings {
+  // End paths in a cached estimate of the reflected radiance instead of
+  // tracing them further. The cache learns from the paths themselves.
+  bool enabled = false;
+  // Bounces traced before a path may terminate into the cache.
+  int terminateDepth = 3;
+  // Samples a cell needs before lookups trust it.
+  int minSamples = 16;
+  // Bound on the hash table; records into a full table are dropped.
+  size_t maxMemoryMB = 16;
+  // Edge of the finest cells relative to the scene diagonal.
+  float cellScale = 1.0f / 512.0f;
+};
+
+// Spatial hash grid of reflected radiance keyed on the position cell, the
+// dominant axis of the normal and a level of detail that coarsens cells
+// with the length of the ray reaching the point. Open addressing with a
+// short linear probe; all operations are lock-free.
+class RadianceCache {
+public:
+  RadianceCache(const math::BBox &bounds, const RadianceCacheSettings &settings);
+
+  int terminateDepth() const { return settings_.terminateDepth; }
+
+  // Mean radiance of the cell, false while it has too few samples.
+  bool lookup(const Vector3 &p, const Vector3 &N, float distance,
+              Vector3 &radiance) const;
+  void record(const Vector3 &p, const Vector3 &N, float distance,
+              const Vector3 &radiance);
+
+  size_t capacity() const { return capacity_; }
+  size_t usedEntries() const;
+  size_t memoryBytes() const { return capacity_ * sizeof(Entry); }
+  // Lookups and hits are counted as Stat::CacheLookups and Stat::CacheHits.
+  long long dropped() const { return dropped_.load(); }
+
+private:
+  struct Entry {
+    // 0 marks a free slot.
+    std::atomic<std::uint64_t> key{0};
+    std::atomic<float> sum[3] = {};
+    std::atomic<std::uint32_t> count{0};
+  };
+
+  std::uint64_t key(const Vector3 &p, const Vector3 &N, float distance) const;
+  Entry *find(std::uint64_t key, bool insert) const;
+
+  RadianceCacheSettings settings_;
+  Vector3 origin_;
+  float cellSize_;
+  size_t capacity_;
+  std::unique_ptr<Entry[]> entries_;
+
+  std::atomic<long long> dropped_{0};
+};
@@ -0,0 +1,822 @@
+#include "render.h"
+
+#include "brdf.h"
+#include "concurrency.h"
+#include "image.h"
+#include "instrument.h"
+#include "integrator.h"
+#include "timeline.h"
+#include "wavefront.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <limits>
+
+// Vector3 getUniformSampleOffset( int index, int side_count )
+//{
+//	const float haflDist = 0.5 / side_count;
+//	const float dist = 1.0 / side_count;
+//	const float x = index % side_count;
+//	const float y = std::floor( index / side_count );
+//	return Vector3( haflDist + x * dist, haflDist + y * dist, 0.0 );
+// }
+
+Vector3 getUniformSampleOffset(int index, int side_count)
+{
+	const float x_idx = (float)(index % side_count);
+	const float y_idx = (float)std::floor(index / side_count);
+
+	const float dist = 1.0f / side_count;
+
+	const float jitterX = randomFloat();
+	const float jitterY = randomFloat();
+
+	const float u = (x_idx + jitterX) * dist;
+	const float v = (y_idx + jitterY) * dist;
+
+	return Vector3(u, v, 0.0f);
+}
+
+void PixelEstimate::add(const Vector3& color)
+{
+	const float lum = math::luminance(color);
+	sum += color;
+	lumSum += lum;
+	lumSqSum += lum * lum;
+	++samples;
+}
+
+Vector3 PixelEstimate::mean() const
+{
+	if (samples == 0)
+		return Vector3();
+	return sum / float(samples);
+}
+
+float PixelEstimate::relativeError() const
+{
+	if (samples < 2)
+		return std::numeric_limits<float>::max();
+
+	const float stdError = std::sqrt(meanVariance());
+	if (stdError == 0.0f)
+		return 0.0f;
+	return stdError / std::max(lumSum / float(samples), 1e-3f);
+}
+
+float PixelEstimate::meanVariance() const
+{
+	if (samples < 2)
+		return 0.0f;
+
+	const float n = float(samples);
+	const float mean = lumSum / n;
+	return std::max(0.0f, (lumSqSum - lumSum * mean) / (n - 1.0f)) / n;
+}
+
+CameraRays::CameraRays(const Camera& camera, std::uint16_t width, std::uint16_t height)
+	: camera_(camera), width_(width), height_(height)
+{
+	forward_ = unit_vector(camera.target - camera.pos);
+	right_ = unit_vector(cross(forward_, camera.up));
+	up_ = cross(right_, forward_);
+
+	pixSize_ = 1.0f / height;
+	viewportHeight_ = 2.0f * std::tan((camera.fov) * 0.5f);
+	leftTop_ = Vector3(-camera.aspectRatio * viewportHeight_ / 2.0f, viewportHeight_ / 2.0f, 1.0f);
+}
+
+math::Ray CameraRays::generate(int x, int y, const Vector3& offset) const
+{
+	const float u = float(x) / width_;
+	const float v = float(y) / height_;
+
+	const Vector3 pixPosVS = leftTop_ + Vector3((pixSize_ * offset.x() + u * camera_.aspectRatio) * viewportHeight_, (-pixSize_ * offset.y() - v) * viewportHeight_, 0.0f);
+	const Vector3 pixPos = camera_.pos + pixPosVS.x() * right_ + pixPosVS.y() * up_ + pixPosVS.z() * forward_;
+
+	return math::Ray({ camera_.pos, unit_vector(pixPos - camera_.pos) });
+}
+
+Renderer::Renderer(const Scene& scene, const RenderSettings& settings, TaskManager& pool)
+	: scene_(scene),
+	settings_(settings),
+	pool_(pool),
+	width_(settings.width),
+	height_(std::uint16_t(settings.width / scene.camera().aspectRatio)),
+	rays_(scene.camera(), width_, height_)
+{
+	pixels_.resize(width_ * height_);
+	if (settings_.costMap != CostMap::None)
+		cost_.resize(pixels_.size());
+	buildTiles();
+	initBRDFTables();
+
+	if (settings_.guiding.enabled && settings_.mode == RenderMode::Progressive && !settings_.wavefront)
+	{
+		guide_ = std::make_unique<SDTree>(scene_.bounds(), settings_.guiding);
+		settings_.integrator.guide = guide_.get();
+	}
+
+	// The wavefront integrator does not call trace() and has no use for it.
+	if (settings_.radianceCache.enabled && !settings_.wavefront)
+	{
+		cache_ = std::make_unique<RadianceCache>(scene_.bounds(), settings_.radianceCache);
+		settings_.integrator.cache = cache_.get();
+	}
+
+	integrator_ = &selectIntegrator(scene_, settings_.integrator);
+
+	if (settings_.wavefront)
+		wavefront_ = std::make_unique<WavefrontIntegrator>(scene_, rays_, settings_.integrator, settings_.raySorting, pool_);
+}
+
+Renderer::~Renderer() = default;
+
+void Renderer::buildTiles()
+{
+	const int tileSize = std::max(1, settings_.tileSize);
+	const int tilesX = (width_ + tileSize - 1) / tileSize;
+	const int tilesY = (height_ + tileSize - 1) / tileSize;
+
+	auto morton = [](std::uint32_t x, std::uint32_t y) {
+		auto spread = [](std::uint32_t v) {
+			v &= 0xffff;
+			v = (v | (v << 8)) & 0x00ff00ff;
+			v = (v | (v << 4)) & 0x0f0f0f0f;
+			v = (v | (v << 2)) & 0x33333333;
+			v = (v | (v << 1)) & 0x55555555;
+			return v;
+		};
+		return spread(x) | (spread(y) << 1);
+	};
+
+	std::vector<std::pair<std::uint32_t, Tile>> ordered;
+	for (int ty = 0; ty < tilesY; ++ty)
+	{
+		for (int tx = 0; tx < tilesX; ++tx)
+		{
+			const Tile tile{ tx * tileSize, ty * tileSize, std::min<int>(width_, (tx + 1) * tileSize), std::min<int>(height_, (ty + 1) * tileSize) };
+			ordered.push_back({ morton(tx, ty), tile });
+		}
+	}
+	std::sort(ordered.begin(), ordered.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+	tiles_.clear();
+	pixelTile_.assign(width_ * height_, 0);
+	for (const auto& [code, tile] : ordered)
+	{
+		for (int y = tile.y0; y < tile.y1; ++y)
+			for (int x = tile.x0; x < tile.x1; ++x)
+				pixelTile_[y * width_ + x] = int(tiles_.size());
+		tiles_.push_back(tile);
+	}
+}
+
+void Renderer::render()
+{
+	timeline::Scope scope("render");
+	finished_ = false;
+	token_ = generation_.token();
+	statsStart_ = StatsSnapshot::take();
+	workersStart_ = pool_.workerStats();
+	start_ = std::chrono::steady_clock::now();
+
+	if (settings_.mode == RenderMode::Adaptive)
+		renderAdaptive();
+	else if (settings_.mode == RenderMode::Progressive)
+		renderProgressive();
+	else
+		renderFixed();
+
+	// The statistics cover the render passes only; the AOV camera rays and
+	// the denoiser are timed on their own.
+	finishStats();
+	if (token_.cancelled())
+	{
+		finished_ = true;
+		return;
+	}
+
+	if (settings_.writeAOVs || settings_.denoise)
+		renderAOVs();
+
+	if (settings_.denoise)
+	{
+		timeline::Scope denoiseScope("denoise");
+		const auto denoiseStart = std::chrono::steady_clock::now();
+		denoised_ = denoise(image(), aovs_, width_, height_, settings_.denoiser, pool_);
+		denoiseMs_ = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - denoiseStart).count();
+	}
+
+	finished_ = true;
+}
+
+void Renderer::finishStats()
+{
+	renderSeconds_ = elapsedSeconds();
+	statsTotal_ = stats();
+	workersTotal_ = pool_.workerStats();
+}
+
+void Renderer::renderAOVs()
+{
+	timeline::Scope scope("AOVs");
+	const auto start = std::chrono::steady_clock::now();
+	const int samples = std::max(1, settings_.aovSamples);
+	const int side = std::max(1, int(std::sqrt(float(samples))));
+
+	aovs_.resize(pixels_.size());
+
+	parallelFor(pool_, 0, pixels_.size(), 1024, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i)
+		{
+			const int x = int(i % width_);
+			const int y = int(i / width_);
+
+			Vector3 albedo;
+			Vector3 normal;
+			float depth = 0.0f;
+			int hits = 0;
+
+			for (int s = 0; s < samples; ++s)
+			{
+				const math::Ray ray = rays_.generate(x, y, getUniformSampleOffset(s % (side * side), side));
+
+				math::Triangle tr;
+				const float t = scene_.intersect(ray, RAY_T_MIN, RAY_T_MAX, tr);
+				if (t >= RAY_T_MAX)
+					continue;
+
+				Vector3 n = interpolatedNormal(tr, ray.origin + ray.direction * t);
+				if (dot(n, ray.direction) > 0.0f)
+					n = -n;
+
+				albedo += scene_.materials()[tr.matIndex].albedo;
+				normal += n;
+				depth += t;
+				++hits;
+			}
+
+			if (hits > 0)
+			{
+				aovs_.albedo[i] = albedo / float(hits);
+				aovs_.normal[i] = normal.length_squared() > 0.0f ? unit_vector(normal) : Vector3();
+				aovs_.depth[i] = depth / float(hits);
+			}
+			aovs_.variance[i] = pixels_[i].meanVariance();
+		}
+		});
+
+	aovMs_ = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+std::vector<Vector3> Renderer::image() const
+{
+	std::vector<Vector3> data(pixels_.size());
+	for (size_t i = 0; i < pixels_.size(); ++i)
+		data[i] = pixels_[i].mean();
+	return data;
+}
+
+std::vector<float> Renderer::costImage() const
+{
+	const float scale = settings_.costMap == CostMap::Time ? 1e-3f : 1.0f;
+	std::vector<float> costs(cost_.size());
+	for (size_t i = 0; i < cost_.size(); ++i)
+		costs[i] = pixels_[i].samples > 0 ? cost_[i] * scale / float(pixels_[i].samples) : 0.0f;
+	return costs;
+}
+
+std::uint64_t Renderer::costCounter() const
+{
+	switch (settings_.costMap)
+	{
+	case CostMap::Nodes:
+		return localStat(Stat::NodesVisited);
+	case CostMap::Triangles:
+		return localStat(Stat::TrianglesTested);
+	case CostMap::PathLength:
+		return localStat(Stat::PrimaryRays) + localStat(Stat::SecondaryRays);
+	case CostMap::Time:
+		return std::uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+	default:
+		return 0;
+	}
+}
+
+std::vector<float> Renderer::sampleCounts() const
+{
+	std::vector<float> counts(pixels_.size());
+	for (size_t i = 0; i < pixels_.size(); ++i)
+		counts[i] = float(pixels_[i].samples);
+	return counts;
+}
+
+long long Renderer::sampleBudget() const
+{
+	return (long long)pixels_.size() * settings_.sideSampleCount * settings_.sideSampleCount;
+}
+
+float Renderer::progress() const
+{
+	if (settings_.mode != RenderMode::Progressive)
+		return std::min(1.0f, float(double(completedSamples()) / double(sampleBudget())));
+
+	float fraction = 0.0f;
+	if (settings_.progressiveTimeBudget > 0.0f)
+		fraction = std::max(fraction, elapsedSeconds() / settings_.progressiveTimeBudget);
+	if (settings_.progressiveMaxPasses > 0)
+		fraction = std::max(fraction, float(passes_.load()) / settings_.progressiveMaxPasses);
+	const float noise = noise_.load();
+	if (settings_.progressiveNoiseTarget > 0.0f && noise > 0.0f)
+		fraction = std::max(fraction, settings_.progressiveNoiseTarget / noise);
+	return std::min(1.0f, fraction);
+}
+
+float Renderer::elapsedSeconds() const
+{
+	return std::chrono::duration<float>(std::chrono::steady_clock::now() - start_).count();
+}
+
+void Renderer::samplePixel(int index, PixelEstimate& pixel, int count) const
+{
+	const int x = index % width_;
+	const int y = index / width_;
+	const int strata = settings_.sideSampleCount * settings_.sideSampleCount;
+
+	for (int i = 0; i < count; ++i)
+	{
+		const int s = (pixel.samples) % strata;
+		const Vector3 offset = getUniformSampleOffset(s, settings_.sideSampleCount);
+		pixel.add(integrator_->trace(rays_.generate(x, y, offset), scene_, settings_.integrator, 0, 0.0f));
+	}
+}
+
+void Renderer::renderTile(const std::vector<int>& pixels, int samplesPerPixel)
+{
+	timeline::Scope scope("tile");
+	// Accumulate into a private buffer and commit once, so workers never
+	// write next to each other in pixels_ while tracing. The buffer is kept
+	// per thread, tiles do not allocate once it has grown.
+	static thread_local std::vector<PixelEstimate> local;
+	static thread_local std::vector<float> localCost;
+	local.resize(pixels.size());
+	for (size_t i = 0; i < pixels.size(); ++i)
+		local[i] = pixels_[pixels[i]];
+
+	const bool measure = !cost_.empty();
+	localCost.assign(measure ? pixels.size() : 0, 0.0f);
+
+	if (settings_.restir.enabled && settings_.integrator.nee)
+	{
+		// Pixels of a tile are resampled together, each gets an equal share.
+		const std::uint64_t before = measure ? costCounter() : 0;
+		renderReSTIRTile(scene_, rays_, width_, pixels, samplesPerPixel, settings_.sideSampleCount, settings_.integrator, settings_.restir, local, restirStats_, token_);
+		if (measure)
+			localCost.assign(pixels.size(), float(costCounter() - before) / float(pixels.size()));
+	}
+	else
+	{
+		for (size_t i = 0; i < pixels.size() && !token_.cancelled(); ++i)
+		{
+			const std::uint64_t before = measure ? costCounter() : 0;
+			samplePixel(pixels[i], local[i], samplesPerPixel);
+			if (measure)
+				localCost[i] = float(costCounter() - before);
+		}
+	}
+
+	// A tile of a cancelled render is stale, even if it got to the end. The
+	// token is checked per pixel so a cancel during the commit stops it too.
+	size_t committed = 0;
+	for (; committed < pixels.size() && !token_.cancelled(); ++committed)
+	{
+		pixels_[pixels[committed]] = local[committed];
+		if (measure)
+			cost_[pixels[committed]] += localCost[committed];
+	}
+
+	addStat(Stat::Samples, committed * samplesPerPixel);
+}
+
+void Renderer::renderPixels(const std::vector<int>& pixels, int samplesPerPixel, TaskPriority priority)
+{
+	if (wavefront_)
+	{
+		renderWavefront(pixels, samplesPerPixel);
+		return;
+	}
+
+	std::vector<std::vector<int>> tilePixels(tiles_.size());
+	for (int index : pixels)
+		tilePixels[pixelTile_[index]].push_back(index);
+
+	const PixelRect& view = settings_.viewport;
+	std::vector<std::vector<int>> visible;
+	std::vector<std::vector<int>> hidden;
+	for (size_t t = 0; t < tiles_.size(); ++t)
+	{
+		if (tilePixels[t].empty())
+			continue;
+		const Tile& tile = tiles_[t];
+		const bool inView = !view.empty() && tile.x0 < view.x1 && view.x0 < tile.x1 && tile.y0 < view.y1 && view.y0 < tile.y1;
+		(inView ? visible : hidden).push_back(std::move(tilePixels[t]));
+	}
+
+	// Tiles skip their work once the render is cancelled, so the groups
+	// drain quickly.
+	const auto render = [this, samplesPerPixel](const std::vector<int>& tile) { renderTile(tile, samplesPerPixel); };
+	TaskGroup visibleGroup(pool_, TaskPriority::High, token_);
+	visibleGroup.runBulk(visible.begin(), visible.end(), render);
+	TaskGroup hiddenGroup(pool_, priority, token_);
+	hiddenGroup.runBulk(hidden.begin(), hidden.end(), render);
+	visibleGroup.wait();
+	hiddenGroup.wait();
+}
+
+void Renderer::renderWavefront(const std::vector<int>& pixels, int samplesPerPixel)
+{
+	const size_t pixelsPerBatch = std::max<size_t>(1, settings_.wavefrontBatchSize / samplesPerPixel);
+
+	std::vector<int> batch;
+	for (size_t begin = 0; begin < pixels.size() && !token_.cancelled(); begin += pixelsPerBatch)
+	{
+		const size_t end = std::min(pixels.size(), begin + pixelsPerBatch);
+		batch.assign(pixels.begin() + begin, pixels.begin() + end);
+		timeline::Scope scope("wavefront batch");
+
+		wavefront_->render(batch, samplesPerPixel, width_, settings_.sideSampleCount, pixels_);
+		addStat(Stat::Samples, batch.size() * samplesPerPixel);
+	}
+}
+
+void Renderer::renderFixed()
+{
+	std::vector<int> all(pixels_.size());
+	for (size_t i = 0; i < all.size(); ++i)
+		all[i] = int(i);
+
+	renderPixels(all, settings_.sideSampleCount * settings_.sideSampleCount);
+}
+
+void Renderer::renderAdaptive()
+{
+	const long long budget = sampleBudget();
+	rounds_.clear();
+	// The initial pass alone must not exceed the budget of a fixed render.
+	const int strata = settings_.sideSampleCount * settings_.sideSampleCount;
+	const int initial = std::max(2, std::min({ settings_.adaptiveInitialSamples, settings_.adaptiveMaxSamples, strata }));
+
+	std::vector<int> active(pixels_.size());
+	for (size_t i = 0; i < active.size(); ++i)
+		active[i] = int(i);
+
+	renderPixels(active, initial);
+	long long spent = (long long)active.size() * initial;
+
+	// Refinement rounds queue behind other work outside the viewport.
+	for (int round = 1; spent < budget && !token_.cancelled(); ++round)
+	{
+		active.clear();
+		for (size_t i = 0; i < pixels_.size(); ++i)
+		{
+			const PixelEstimate& p = pixels_[i];
+			if (p.samples < settings_.adaptiveMaxSamples && p.relativeError() > settings_.adaptiveThreshold)
+				active.push_back(int(i));
+		}
+		if (active.empty())
+			break;
+
+		// The last round may not afford every active pixel; the noisiest ones go first.
+		long long perPixel = std::min<long long>(settings_.adaptiveRoundSamples, (budget - spent) / (long long)active.size());
+		if (perPixel == 0)
+		{
+			std::sort(active.begin(), active.end(), [this](int a, int b) {
+				return pixels_[a].relativeError() > pixels_[b].relativeError();
+				});
+			active.resize(size_t(budget - spent));
+			perPixel = 1;
+		}
+
+		timeline::Scope scope("adaptive round");
+		renderPixels(active, int(perPixel), TaskPriority::Low);
+		spent += (long long)active.size() * perPixel;
+
+		rounds_.push_back({ active.size(), int(perPixel) });
+	}
+}
+
+float Renderer::noiseEstimate() const
+{
+	// Mean relative error over the pixels that received any light; black
+	// background would otherwise pull the estimate towards zero.
+	double sum = 0.0;
+	size_t count = 0;
+	for (const PixelEstimate& p : pixels_)
+	{
+		if (p.lumSum <= 0.0f)
+			continue;
+		sum += std::min(p.relativeError(), 1.0f);
+		++count;
+	}
+	return count ? float(sum / count) : 0.0f;
+}
+
+void Renderer::renderProgressive()
+{
+	std::vector<int> all(pixels_.size());
+	for (size_t i = 0; i < all.size(); ++i)
+		all[i] = int(i);
+
+	passes_ = 0;
+	noise_ = 0.0f;
+	float lastFlush = 0.0f;
+
+	while (true)
+	{
+		// Passes after the first only refine, they queue behind other work
+		// outside the viewport.
+		timeline::Scope scope("progressive pass");
+		const float passStart = elapsedSeconds();
+		renderPixels(all, settings_.progressivePassSamples, passes_ > 0 ? TaskPriority::Low : TaskPriority::Normal);
+		const float now = elapsedSeconds();
+		if (token_.cancelled())
+		{
+			stopReason_ = "cancelled";
+			break;
+		}
+
+		const int passes = passes_.fetch_add(1) + 1;
+		noise_ = noiseEstimate();
+
+		// Guiding trains on iterations that double in length.
+		if (guide_ && (passes & (passes - 1)) == 0)
+		{
+			const auto refineStart = std::chrono::steady_clock::now();
+			guide_->refine();
+			guideMs_ += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - refineStart).count();
+		}
+
+		if (settings_.progressiveNoiseTarget > 0.0f && passes_ > 1 && noise_ <= settings_.progressiveNoiseTarget)
+		{
+			stopReason_ = "noise target reached";
+			break;
+		}
+		if (settings_.progressiveMaxPasses > 0 && passes_ >= settings_.progressiveMaxPasses)
+		{
+			stopReason_ = "pass limit reached";
+			break;
+		}
+		// Stop if the next pass would not finish before the deadline.
+		if (settings_.progressiveTimeBudget > 0.0f && now + (now - passStart) > settings_.progressiveTimeBudget)
+		{
+			stopReason_ = "time budget reached";
+			break;
+		}
+
+		if (settings_.progressiveFlushInterval > 0.0f && now - lastFlush >= settings_.progressiveFlushInterval)
+		{
+			// Written aside and renamed over the output, so a job killed
+			// mid-write still leaves the previous flush intact.
+			const std::string partial = settings_.outputFile + ".part";
+			if (saveImageToFile(partial.c_str(), width_, height_, image(), &pool_))
+				std::rename(partial.c_str(), settings_.outputFile.c_str());
+			lastFlush = now;
+		}
+	}
+}
+
+void Renderer::report() const
+{
+	if (cancelled())
+		printf("Render cancelled\n");
+	if (wavefront_)
+		reportWavefront();
+	else
+	{
+		reportIntegrator();
+		if (settings_.restir.enabled && settings_.integrator.nee)
+			reportReSTIR();
+	}
+	if ((settings_.writeAOVs || settings_.denoise) && !cancelled())
+		printf("AOVs: %.1f ms\n", aovMs_);
+	if (settings_.denoise && !cancelled())
+		printf("Denoiser: %d a-trous iterations, %.1f ms\n", settings_.denoiser.iterations, denoiseMs_);
+
+	if (settings_.mode == RenderMode::Adaptive)
+		reportAdaptive();
+	else if (settings_.mode == RenderMode::Progressive)
+		reportProgressive();
+	if (guide_)
+		reportGuiding();
+	if (cache_)
+		reportRadianceCache();
+	reportStats();
+#if PBR_INSTRUMENT
+	instrument::report();
+#endif
+}
+
+void Renderer::reportStats() const
+{
+	const StatsSnapshot& s = statsTotal_;
+	const double seconds = std::max(renderSeconds_, 1e-9);
+	const double rays = double(std::max<std::uint64_t>(s.rays(), 1));
+
+	printf("Rays: %llu primary, %llu secondary, %llu shadow, %.2f Mrays/s\n", (unsigned long long)s[Stat::PrimaryRays],
+		(unsigned long long)s[Stat::SecondaryRays], (unsigned long long)s[Stat::ShadowRays], s.rays() / seconds * 1e-6);
+	// Rays of dropped tiles are counted but their samples are not, so a
+	// cancelled render has no meaningful per-sample rates.
+	if (cancelled())
+		printf("Samples: %llu committed before the cancel\n", (unsigned long long)s[Stat::Samples]);
+	else
+		printf("Samples: %llu, %.2f Msamples/s, %.2f rays per sample\n", (unsigned long long)s[Stat::Samples], s[Stat::Samples] / seconds * 1e-6,
+			s.rays() / double(std::max<std::uint64_t>(s[Stat::Samples], 1)));
+	printf("BVH: %.1f nodes visited and %.1f triangles tested per ray\n", s[Stat::NodesVisited] / rays, s[Stat::TrianglesTested] / rays);
+
+	double busy = 0.0;
+	for (size_t i = 0; i < workersTotal_.size(); ++i)
+		busy += workersTotal_[i].busySeconds - workersStart_[i].busySeconds;
+	printf("Workers: %zu, %.1f%% busy on average, %lld task blocks from the heap\n", workersTotal_.size(),
+		100.0 * busy / (seconds * std::max<size_t>(workersTotal_.size(), 1)), TaskPool::heapAllocations());
+	for (size_t i = 0; i < workersTotal_.size(); ++i)
+	{
+		const TaskManager::WorkerStats& end = workersTotal_[i];
+		const TaskManager::WorkerStats& begin = workersStart_[i];
+		printf("  worker %2zu (node %d, cpu %3d): %5.1f%% busy, %llu tasks, %llu stolen\n", i, end.node, end.cpu,
+			100.0 * (end.busySeconds - begin.busySeconds) / seconds, (unsigned long long)(end.tasks - begin.tasks),
+			(unsigned long long)(end.steals - begin.steals));
+	}
+}
+
+bool Renderer::writeStats(const char* path, const std::string& scene) const
+{
+	FILE* file = std::fopen(path, "w");
+	if (!file)
+		return false;
+
+	const StatsSnapshot& s = statsTotal_;
+	const double seconds = std::max(renderSeconds_, 1e-9);
+	const char* const modes[] = { "fixed", "adaptive", "progressive" };
+
+	// The scene path is written as is; it is not expected to need escaping.
+	fprintf(file, "{\n");
+	fprintf(file, "  \"scene\": \"%s\",\n", scene.c_str());
+	fprintf(file, "  \"width\": %d,\n  \"height\": %d,\n", width_, height_);
+	fprintf(file, "  \"mode\": \"%s\",\n", modes[int(settings_.mode)]);
+	fprintf(file, "  \"integrator\": \"%s\",\n", wavefront_ ? "wavefront" : integratorVariantName(integrator_->features).c_str());
+	fprintf(file, "  \"cancelled\": %s,\n", cancelled() ? "true" : "false");
+	fprintf(file, "  \"seconds\": %.6f,\n", renderSeconds_);
+	fprintf(file, "  \"counters\": {\n");
+	for (int i = 0; i < STAT_COUNT; ++i)
+		fprintf(file, "    \"%s\": %llu,\n", statName(Stat(i)), (unsigned long long)s.values[i]);
+	fprintf(file, "    \"task_heap_allocations\": %lld\n  },\n", TaskPool::heapAllocations());
+	fprintf(file, "  \"rates\": {\n");
+	fprintf(file, "    \"rays_per_second\": %.1f,\n", s.rays() / seconds);
+	if (!cancelled())
+		fprintf(file, "    \"samples_per_second\": %.1f,\n", s[Stat::Samples] / seconds);
+	fprintf(file, "    \"nodes_per_ray\": %.3f,\n", s[Stat::NodesVisited] / double(std::max<std::uint64_t>(s.rays(), 1)));
+	fprintf(file, "    \"triangles_per_ray\": %.3f\n  },\n", s[Stat::TrianglesTested] / double(std::max<std::uint64_t>(s.rays(), 1)));
+	fprintf(file, "  \"workers\": [");
+	for (size_t i = 0; i < workersTotal_.size(); ++i)
+	{
+		const TaskManager::WorkerStats& end = workersTotal_[i];
+		const TaskManager::WorkerStats& begin = workersStart_[i];
+		fprintf(file, "%s\n    {\"node\": %d, \"cpu\": %d, \"tasks\": %llu, \"steals\": %llu, \"busy_seconds\": %.6f, \"utilisation\": %.4f}",
+			i ? "," : "", end.node, end.cpu, (unsigned long long)(end.tasks - begin.tasks), (unsigned long long)(end.steals - begin.steals),
+			end.busySeconds - begin.busySeconds, (end.busySeconds - begin.busySeconds) / seconds);
+	}
+	fprintf(file, "\n  ]\n}\n");
+	return std::fclose(file) == 0;
+}
+
+void Renderer::reportIntegrator() const
+{
+	printf("Integrator: %s, variant %u of %u\n", integratorVariantName(integrator_->features).c_str(), integrator_->features, INTEGRATOR_VARIANT_COUNT);
+	printf("  dispatch table:");
+	for (unsigned i = 0; i < INTEGRATOR_VARIANT_COUNT; ++i)
+		printf("%s%s%u %s", i % 4 ? ", " : "\n    ", i == integrator_->features ? "*" : "", i, integratorVariantName(i).c_str());
+	printf("\n");
+}
+
+void Renderer::reportReSTIR() const
+{
+	const double candidateMs = restirStats_.candidateNs.load() * 1e-6;
+	const double spatialMs = restirStats_.spatialNs.load() * 1e-6;
+	const double shadeMs = restirStats_.shadeNs.load() * 1e-6;
+
+	printf("ReSTIR: %d candidates, %d spatial neighbours within %d px (thread time)\n", settings_.restir.candidates, settings_.restir.spatialSamples, settings_.restir.spatialRadius);
+	printf("  candidates %10.1f ms (%lld light samples)\n", candidateMs, restirStats_.candidates.load());
+	printf("  spatial    %10.1f ms\n", spatialMs);
+	printf("  shade      %10.1f ms (%lld shadow rays, includes the rest of the path)\n", shadeMs, restirStats_.shadowRays.load());
+}
+
+void Renderer::reportWavefront() const
+{
+	const WavefrontStats& stats = wavefront_->stats();
+	const double total = stats.generateMs + stats.extendMs + stats.shadeMs + stats.shadowMs + stats.accumulateMs;
+
+	printf("Wavefront: %lld paths, %lld extension rays, %lld shadow rays\n", stats.paths, stats.extensionRays, stats.shadowRays);
+	printf("  generate   %10.1f ms\n", stats.generateMs);
+	printf("  extend     %10.1f ms (%.2f Mrays/s)\n", stats.extendMs, stats.extendMs > 0.0 ? stats.extensionRays / stats.extendMs / 1000.0 : 0.0);
+	printf("  shade      %10.1f ms\n", stats.shadeMs);
+	printf("  shadow     %10.1f ms (%.2f Mrays/s)\n", stats.shadowMs, stats.shadowMs > 0.0 ? stats.shadowRays / stats.shadowMs / 1000.0 : 0.0);
+	printf("  accumulate %10.1f ms\n", stats.accumulateMs);
+	printf("  total      %10.1f ms\n", total);
+
+	if (stats.secondaryRays == 0)
+		return;
+
+	const double sortedRate = stats.secondaryExtendMs > 0.0 ? stats.secondaryRays / stats.secondaryExtendMs / 1000.0 : 0.0;
+	printf("Secondary extend: %lld rays, %.1f ms (%.2f Mrays/s)%s\n", stats.secondaryRays, stats.secondaryExtendMs, sortedRate, settings_.raySorting.enabled ? ", sorted" : "");
+	if (!settings_.raySorting.enabled)
+		return;
+
+	printf("Ray sorting: batch %d, %.1f ms\n", settings_.raySorting.batchSize, stats.sortMs);
+	if (settings_.raySorting.benchmark && stats.secondaryExtendMs > 0.0)
+	{
+		printf("Secondary extend unsorted: %.1f ms (%.2f Mrays/s)\n", stats.unsortedExtendMs, stats.secondaryRays / stats.unsortedExtendMs / 1000.0);
+		printf("Traversal speedup: %.2fx, %.2fx including the sort\n", stats.unsortedExtendMs / stats.secondaryExtendMs, stats.unsortedExtendMs / (stats.secondaryExtendMs + stats.sortMs));
+	}
+}
+
+void Renderer::reportProgressive() const
+{
+	printf("Progressive: %d passes, %d samples per pixel, %s\n", passes_.load(), passes_.load() * settings_.progressivePassSamples, stopReason_);
+	printf("Noise estimate (mean relative error): %.4f\n", noise_.load());
+}
+
+void Renderer::reportGuiding() const
+{
+	printf("Guiding: %d iterations, %zu spatial cells, %.1f of %zu MB, refine %.1f ms\n", guide_->iterations(), guide_->leafCount(),
+		guide_->memoryBytes() / double(1 << 20), settings_.guiding.maxMemoryMB, guideMs_);
+}
+
+void Renderer::reportRadianceCache() const
+{
+	const std::uint64_t lookups = statsTotal_[Stat::CacheLookups];
+	printf("Radiance cache: %zu of %zu entries (%.1f MB), %llu lookups, %.1f%% hits, %lld records dropped\n", cache_->usedEntries(),
+		cache_->capacity(), cache_->memoryBytes() / double(1 << 20), (unsigned long long)lookups,
+		lookups > 0 ? 100.0 * statsTotal_[Stat::CacheHits] / lookups : 0.0, cache_->dropped());
+}
+
+void Renderer::reportAdaptive() const
+{
+	const int tileSize = std::max(1, settings_.tileSize);
+	const int tilesX = (width_ + tileSize - 1) / tileSize;
+	const int tilesY = (height_ + tileSize - 1) / tileSize;
+
+	std::vector<long long> tileSamples(tilesX * tilesY, 0);
+	std::vector<bool> tileConverged(tilesX * tilesY, true);
+
+	int converged = 0;
+	int minSamples = std::numeric_limits<int>::max();
+	int maxSamples = 0;
+	long long total = 0;
+
+	for (int y = 0; y < height_; ++y)
+	{
+		for (int x = 0; x < width_; ++x)
+		{
+			const PixelEstimate& p = pixels_[y * width_ + x];
+			const int tile = (y / tileSize) * tilesX + x / tileSize;
+			const bool done = p.relativeError() <= settings_.adaptiveThreshold;
+
+			converged += done ? 1 : 0;
+			tileConverged[tile] = tileConverged[tile] && done;
+			tileSamples[tile] += p.samples;
+			minSamples = std::min(minSamples, p.samples);
+			maxSamples = std::max(maxSamples, p.samples);
+			total += p.samples;
+		}
+	}
+
+	const int convergedTiles = (int)std::count(tileConverged.begin(), tileConverged.end(), true);
+	const long long maxTile = *std::max_element(tileSamples.begin(), tileSamples.end());
+
+	for (size_t i = 0; i < rounds_.size(); ++i)
+		printf("Adaptive round %zu: %zu active pixels, +%d samples each\n", i + 1, rounds_[i].activePixels, rounds_[i].samples);
+	printf("Adaptive sampling: %d/%zu pixels converged, %d/%d tiles converged\n", converged, pixels_.size(), convergedTiles, tilesX * tilesY);
+	printf("Samples per pixel: min %d, avg %.1f, max %d\n", minSamples, double(total) / pixels_.size(), maxSamples);
+
+	// Share of the budget spent per tile, '@' marks the most expensive tile
+	// and '.' a converged one.
+	const char ramp[] = " -:=+*#%@";
+	printf("Samples per %dx%d tile:\n", tileSize, tileSize);
+	for (int ty = 0; ty < tilesY; ++ty)
+	{
+		for (int tx = 0; tx < tilesX; ++tx)
+		{
+			const int tile = ty * tilesX + tx;
+			if (tileConverged[tile])
+			{
+				putchar('.');
+				continue;
+			}
+			const int level = int(double(tileSamples[tile]) / double(maxTile) * (sizeof(ramp) - 2));
+			putchar(ramp[level]);
+		}
+		putchar('\n');
+	}
+}
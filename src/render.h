@@ -0,0 +1,241 @@
+#pragma once
+
+#include "concurrency.h"
+#include "denoise.h"
+#include "guiding.h"
+#include "integrator.h"
+#include "radiancecache.h"
+#include "restir.h"
+#include "scene.h"
+#include "stats.h"
+#include "utils.h"
+#include "vector.h"
+#include "wavefront.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+enum class RenderMode { Fixed, Adaptive, Progressive };
+
+// Per-pixel cost written instead of radiance, per camera sample.
+enum class CostMap { None, Nodes, Triangles, PathLength, Time };
+
+// Pixels [x0, x1) x [y0, y1).
+struct PixelRect {
+  int x0 = 0, y0 = 0;
+  int x1 = 0, y1 = 0;
+
+  bool empty() const { return x1 <= x0 || y1 <= y0; }
+};
+
+struct RenderSettings {
+  std::uint16_t width = 600;
+  int sideSampleCount = 8;
+  // 0 starts one worker per available CPU.
+  int threads = 0;
+  int maxTasks = 32;
+  // Binds each worker to one core.
+  bool pinThreads = false;
+  // Pixels are rendered in square tiles scheduled in Morton order.
+  int tileSize = 16;
+  // Tiles overlapping the visible part of the image are scheduled at high
+  // priority, ahead of the others and of refinement passes. Empty for
+  // none.
+  PixelRect viewport;
+  RenderMode mode = RenderMode::Fixed;
+  std::string outputFile = "output.ppm";
+  IntegratorSettings integrator;
+  ReSTIRSettings restir;
+  GuidingSettings guiding;
+  RadianceCacheSettings radianceCache;
+
+  // Measured for every pixel while rendering. Not available with
+  // wavefront; ReSTIR tiles spread their cost evenly over their pixels.
+  CostMap costMap = CostMap::None;
+
+  // Trace batches of paths stage by stage instead of one path at a time.
+  bool wavefront = false;
+  int wavefrontBatchSize = 1 << 18;
+  RaySortSettings raySorting;
+
+  // First-hit albedo, normal and depth plus pixel variance, rendered after
+  // accumulation with aovSamples jittered camera rays per pixel.
+  bool writeAOVs = false;
+  int aovSamples = 4;
+  bool denoise = false;
+  DenoiseSettings denoiser;
+
+  // Adaptive mode keeps the fixed mode budget of sideSampleCount^2 samples
+  // per pixel on average, but only the initial pass goes to every pixel.
+  int adaptiveInitialSamples = 16;
+  int adaptiveRoundSamples = 8;
+  int adaptiveMaxSamples = 1024;
+  // Relative standard error of the pixel mean below which a pixel is done.
+  float adaptiveThreshold = 0.05f;
+
+  // Progressive mode renders full-frame passes until the time budget runs
+  // out, the mean relative error drops below the target or maxPasses is
+  // reached. Zero disables a limit. The current estimate is written to
+  // outputFile every flushInterval seconds.
+  int progressivePassSamples = 1;
+  float progressiveTimeBudget = 60.0f;
+  float progressiveNoiseTarget = 0.0f;
+  int progressiveMaxPasses = 0;
+  float progressiveFlushInterval = 10.0f;
+};
+
+// Running estimate of one pixel. Luminance moments give the variance of the
+// mean without storing samples.
+struct PixelEstimate {
+  Vector3 sum;
+  float lumSum = 0.0f;
+  float lumSqSum = 0.0f;
+  int samples = 0;
+
+  void add(const Vector3 &color);
+  Vector3 mean() const;
+  float relativeError() const;
+  // Variance of the mean luminance.
+  float meanVariance() const;
+};
+
+// Jittered position inside stratum index of a side_count^2 grid.
+Vector3 getUniformSampleOffset(int index, int side_count);
+
+class CameraRays {
+public:
+  CameraRays(const Camera &camera, std::uint16_t width, std::uint16_t height);
+
+  // offset is the sample position inside the pixel in [0, 1)^2.
+  math::Ray generate(int x, int y, const Vector3 &offset) const;
+
+private:
+  Camera camera_;
+  std::uint16_t width_;
+  std::uint16_t height_;
+  Vector3 forward_;
+  Vector3 right_;
+  Vector3 up_;
+  Vector3 leftTop_;
+  float pixSize_;
+  float viewportHeight_;
+};
+
+class Renderer {
+public:
+  // Every phase of the render runs on pool.
+  Renderer(const Scene &scene, const RenderSettings &settings,
+           TaskManager &pool);
+  ~Renderer();
+
+  void render();
+  // Abandons the render in flight, from any thread. render() returns once
+  // the running tiles notice; their partial results are dropped.
+  void cancel() { generation_.advance(); }
+  bool cancelled() const { return token_.cancelled(); }
+  void report() const;
+
+  std::uint16_t width() const { return width_; }
+  std::uint16_t height() const { return height_; }
+
+  std::vector<Vector3> image() const;
+  const std::vector<Vector3> &denoisedImage() const { return denoised_; }
+  const AOVBuffers &aovs() const { return aovs_; }
+  std::vector<float> sampleCounts() const;
+  // Chosen cost per sample of every pixel, time in microseconds.
+  std::vector<float> costImage() const;
+
+  long long sampleBudget() const;
+  long long completedSamples() const {
+    return (long long)stats()[Stat::Samples];
+  }
+  // Counters of this render so far, summed over the threads' shards.
+  StatsSnapshot stats() const { return StatsSnapshot::take() - statsStart_; }
+  float elapsedSeconds() const;
+  // Counters, rates and per-worker utilisation of the finished render as
+  // JSON, for comparing runs. False if the file cannot be written.
+  bool writeStats(const char *path, const std::string &scene) const;
+  // Fraction of the work done, for progressive mode the largest fraction
+  // of any of its limits.
+  float progress() const;
+  bool finished() const { return finished_.load(); }
+
+private:
+  struct Tile {
+    int x0, y0;
+    int x1, y1;
+  };
+
+  void buildTiles();
+  void samplePixel(int index, PixelEstimate &pixel, int count) const;
+  // Running total of the cost map metric on the calling thread.
+  std::uint64_t costCounter() const;
+  void renderTile(const std::vector<int> &pixels, int samplesPerPixel);
+  // Tiles outside the viewport are queued at priority.
+  void renderPixels(const std::vector<int> &pixels, int samplesPerPixel,
+                    TaskPriority priority = TaskPriority::Normal);
+  void renderWavefront(const std::vector<int> &pixels, int samplesPerPixel);
+  void reportWavefront() const;
+  void reportReSTIR() const;
+  void renderAOVs();
+
+  void renderFixed();
+  void renderAdaptive();
+  void reportAdaptive() const;
+  void renderProgressive();
+  void reportProgressive() const;
+  void reportGuiding() const;
+  void reportRadianceCache() const;
+  void reportIntegrator() const;
+  void finishStats();
+  void reportStats() const;
+  float noiseEstimate() const;
+
+  const Scene &scene_;
+  RenderSettings settings_;
+  TaskManager &pool_;
+  std::uint16_t width_;
+  std::uint16_t height_;
+  CameraRays rays_;
+
+  struct AdaptiveRound {
+    size_t activePixels;
+    int samples;
+  };
+
+  std::vector<Tile> tiles_;
+  std::vector<int> pixelTile_;
+  std::vector<PixelEstimate> pixels_;
+  // Cost summed over every sample, empty without a cost map.
+  std::vector<float> cost_;
+  std::unique_ptr<WavefrontIntegrator> wavefront_;
+  ReSTIRStats restirStats_;
+  std::unique_ptr<SDTree> guide_;
+  double guideMs_ = 0.0;
+  std::unique_ptr<RadianceCache> cache_;
+  // Path tracer instantiation picked for the scene and settings.
+  const IntegratorVariant *integrator_ = nullptr;
+  AOVBuffers aovs_;
+  std::vector<Vector3> denoised_;
+  double aovMs_ = 0.0;
+  double denoiseMs_ = 0.0;
+  std::vector<AdaptiveRound> rounds_;
+
+  Generation generation_;
+  // Taken when render() starts, cancelled by the next cancel().
+  CancellationToken token_;
+  std::chrono::steady_clock::time_point start_;
+  std::atomic<int> passes_{0};
+  std::atomic<float> noise_{0.0f};
+  const char *stopReason_ = "";
+  StatsSnapshot statsStart_;
+  StatsSnapshot statsTotal_;
+  std::vector<TaskManager::WorkerStats> workersStart_;
+  std::vector<TaskManager::WorkerStats> workersTotal_;
+  double renderSeconds_ = 0.0;
+  std::atomic<bool> finished_{false};
+};
@@ -0,0 +1,283 @@
+#include "restir.h"
+
+#include "render.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <chrono>
+#include <limits>
+
+namespace {
+
+	// A point on an emitter, or a direction for the environment.
+	struct LightCandidate
+	{
+		Vector3 point;
+		Vector3 normal;
+		Vector3 emission;
+		bool environment = false;
+	};
+
+	struct Reservoir
+	{
+		LightCandidate sample;
+		float weightSum = 0.0f;
+		float targetPdf = 0.0f;
+		int count = 0;
+		// Unbiased contribution weight of sample.
+		float weight = 0.0f;
+
+		void update(const LightCandidate& candidate, float w, float pHat)
+		{
+			weightSum += w;
+			if (w > 0.0f && randomFloat() * weightSum < w)
+			{
+				sample = candidate;
+				targetPdf = pHat;
+			}
+		}
+
+		void finalize()
+		{
+			weight = targetPdf > 0.0f && count > 0 ? weightSum / (count * targetPdf) : 0.0f;
+		}
+	};
+
+	struct PrimaryHit
+	{
+		bool valid = false;
+		Vector3 p;
+		Vector3 N;
+		Vector3 V;
+		float depth = 0.0f;
+		size_t material = 0;
+		// Emission at the hit or the background of a miss.
+		Vector3 radiance;
+	};
+
+	// Samples a candidate from the light sampler; pdf is per unit area for
+	// emitters and per solid angle for the environment.
+	bool sampleCandidate(const Scene& scene, const Vector3& p, LightCandidate& c, float& pdf)
+	{
+		const float environmentProbability = environmentSelectProbability(scene);
+		if (environmentProbability > 0.0f && randomFloat() < environmentProbability)
+		{
+			const EnvironmentSample env = scene.environment().sample(randomFloat(), randomFloat());
+			c.point = env.direction;
+			c.emission = env.radiance;
+			c.environment = true;
+			pdf = environmentProbability * env.pdf;
+			return pdf > 0.0f;
+		}
+
+		if (scene.lights().empty())
+			return false;
+
+		const LightSample light = scene.lights().sample(p, randomFloat(), randomFloat(), randomFloat());
+		c.point = light.position;
+		c.normal = light.normal;
+		c.emission = light.emission;
+		c.environment = false;
+		pdf = (1.0f - environmentProbability) * light.pdfArea;
+		return pdf > 0.0f;
+	}
+
+	// Unshadowed contribution of a candidate in the measure of its pdf.
+	Vector3 evalCandidate(const ShadingRecord& shading, const PrimaryHit& hit, const LightCandidate& c, Vector3& L, float& distance)
+	{
+		if (c.environment)
+		{
+			L = c.point;
+			distance = RAY_T_MAX;
+			return evalScatter(shading, hit.N, hit.V, L) * c.emission;
+		}
+
+		const Vector3 toLight = c.point - hit.p;
+		const float dist2 = toLight.length_squared();
+		if (dist2 <= 0.0f)
+			return Vector3();
+
+		distance = std::sqrt(dist2);
+		L = toLight / distance;
+		const float cosLight = std::abs(dot(c.normal, L));
+		return evalScatter(shading, hit.N, hit.V, L) * c.emission * (cosLight / dist2);
+	}
+
+	float targetPdf(const Scene& scene, const PrimaryHit& hit, const LightCandidate& c)
+	{
+		Vector3 L;
+		float distance;
+		return math::luminance(evalCandidate(scene.shadingTable()[hit.material], hit, c, L, distance));
+	}
+
+	long long elapsedNs(std::chrono::steady_clock::time_point start)
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+	}
+}
+
+void renderReSTIRTile(const Scene& scene, const CameraRays& rays, int width, const std::vector<int>& pixels, int samplesPerPixel, int sideSampleCount,
+	const IntegratorSettings& integrator, const ReSTIRSettings& settings, std::vector<PixelEstimate>& estimates, ReSTIRStats& stats, const CancellationToken& token)
+{
+	const size_t count = pixels.size();
+	const int strata = sideSampleCount * sideSampleCount;
+
+	// Local index of every pixel inside the tile rectangle, -1 for pixels
+	// not rendered in this pass.
+	int x0 = width, y0 = std::numeric_limits<int>::max(), x1 = 0, y1 = 0;
+	for (int index : pixels)
+	{
+		x0 = std::min(x0, index % width);
+		x1 = std::max(x1, index % width);
+		y0 = std::min(y0, index / width);
+		y1 = std::max(y1, index / width);
+	}
+	const int tileWidth = x1 - x0 + 1;
+	std::vector<int> local(size_t(tileWidth) * (y1 - y0 + 1), -1);
+	for (size_t i = 0; i < count; ++i)
+		local[size_t(pixels[i] / width - y0) * tileWidth + (pixels[i] % width - x0)] = int(i);
+
+	std::vector<PrimaryHit> hits(count);
+	std::vector<Reservoir> reservoirs(count);
+	std::vector<Reservoir> merged(count);
+
+	for (int s = 0; s < samplesPerPixel; ++s)
+	{
+		auto start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < count; ++i)
+		{
+			// Checked per pixel like the path tracer; the caller drops the tile.
+			if (token.cancelled())
+				return;
+
+			const int x = pixels[i] % width;
+			const int y = pixels[i] / width;
+			const Vector3 offset = getUniformSampleOffset(estimates[i].samples % strata, sideSampleCount);
+			const math::Ray ray = rays.generate(x, y, offset);
+
+			PrimaryHit& hit = hits[i];
+			Reservoir& r = reservoirs[i];
+			r = Reservoir();
+
+			addStat(Stat::PrimaryRays);
+			math::Triangle tr;
+			const float t = scene.intersect(ray, RAY_T_MIN, RAY_T_MAX, tr);
+			hit.valid = t < RAY_T_MAX;
+			if (!hit.valid)
+			{
+				hit.radiance = scene.environment().eval(ray.direction);
+				continue;
+			}
+
+			hit.p = ray.origin + ray.direction * t;
+			hit.N = interpolatedNormal(tr, hit.p);
+			if (dot(hit.N, ray.direction) > 0.0f)
+				hit.N = -hit.N;
+			hit.V = ray.direction * -1.0f;
+			hit.depth = t;
+			hit.material = tr.matIndex;
+			hit.radiance = scene.materialTable()[tr.matIndex].emission;
+			if (scene.materialTable()[tr.matIndex].black)
+				continue;
+
+			// Weighted reservoir sampling over the candidates
+			for (int k = 0; k < settings.candidates; ++k)
+			{
+				LightCandidate c;
+				float pdf;
+				if (!sampleCandidate(scene, hit.p, c, pdf))
+					continue;
+
+				const float pHat = targetPdf(scene, hit, c);
+				r.update(c, pHat / pdf, pHat);
+			}
+			r.count = settings.candidates;
+			r.finalize();
+		}
+		stats.candidateNs.fetch_add(elapsedNs(start));
+		stats.candidates.fetch_add((long long)count * settings.candidates);
+
+		if (settings.spatialSamples > 0)
+		{
+			start = std::chrono::steady_clock::now();
+			for (size_t i = 0; i < count; ++i)
+			{
+				const PrimaryHit& hit = hits[i];
+				merged[i] = reservoirs[i];
+				if (!hit.valid || reservoirs[i].count == 0)
+					continue;
+
+				// Biased combination: neighbours are accepted on normal and depth
+				// similarity and their samples are not retested for visibility.
+				Reservoir s;
+				const Reservoir& own = reservoirs[i];
+				s.update(own.sample, own.targetPdf * own.weight * own.count, own.targetPdf);
+				s.count = own.count;
+
+				const int x = pixels[i] % width - x0;
+				const int y = pixels[i] / width - y0;
+				for (int k = 0; k < settings.spatialSamples; ++k)
+				{
+					const int nx = x + int((randomFloat() * 2.0f - 1.0f) * settings.spatialRadius);
+					const int ny = y + int((randomFloat() * 2.0f - 1.0f) * settings.spatialRadius);
+					if (nx < 0 || ny < 0 || nx >= tileWidth || ny > y1 - y0)
+						continue;
+
+					const int n = local[size_t(ny) * tileWidth + nx];
+					if (n < 0 || size_t(n) == i || !hits[n].valid || reservoirs[n].count == 0)
+						continue;
+					if (dot(hits[n].N, hit.N) < 0.9f || std::abs(hits[n].depth - hit.depth) > 0.1f * hit.depth)
+						continue;
+
+					const Reservoir& r = reservoirs[n];
+					const float pHat = targetPdf(scene, hit, r.sample);
+					s.update(r.sample, pHat * r.weight * r.count, pHat);
+					s.count += r.count;
+				}
+				s.finalize();
+				merged[i] = s;
+			}
+			reservoirs.swap(merged);
+			stats.spatialNs.fetch_add(elapsedNs(start));
+		}
+
+		start = std::chrono::steady_clock::now();
+		long long shadowRays = 0;
+		for (size_t i = 0; i < count; ++i)
+		{
+			if (token.cancelled())
+				return;
+
+			const PrimaryHit& hit = hits[i];
+			Vector3 color = hit.radiance;
+			if (!hit.valid || scene.materialTable()[hit.material].black)
+			{
+				estimates[i].add(color);
+				continue;
+			}
+
+			const ShadingRecord& shading = scene.shadingTable()[hit.material];
+			const Reservoir& r = reservoirs[i];
+			if (r.weight > 0.0f)
+			{
+				Vector3 L;
+				float distance;
+				const Vector3 direct = evalCandidate(shading, hit, r.sample, L, distance);
+				++shadowRays;
+				addStat(Stat::ShadowRays);
+				if (!scene.occluded(math::Ray({ hit.p, L }), RAY_T_MIN, distance - RAY_T_MIN))
+					color += direct * r.weight;
+			}
+
+			// With a zero BRDF pdf, emitters hit by the bounce get no MIS weight;
+			// the reservoir already accounts for direct light.
+			const ScatterSample scatter = sampleScatter(shading, hit.N, hit.V);
+			if (scatter.pdf > 0.0f)
+				color += trace(math::Ray({ hit.p + scatter.direction * 1e-4f, scatter.direction }), scene, integrator, 1, 0.0f) * scatter.weight;
+
+			estimates[i].add(color);
+		}
+		stats.shadeNs.fetch_add(elapsedNs(start));
+		stats.shadowRays.fetch_add(shadowRays);
+	}
+}
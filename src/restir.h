@@ -0,0 +1,44 @@
+#pragma once
+
+#include "concurrency.h"
+#include "integrator.h"
+#include "scene.h"
+#include "vector.h"
+
+#include <atomic>
+#include <vector>
+
+class CameraRays;
+struct PixelEstimate;
+
+struct ReSTIRSettings {
+  // Direct light at the first hit by resampled importance sampling. Used by
+  // the tiled path tracer when NEE is on; wavefront mode ignores it.
+  bool enabled = false;
+  // Light samples drawn per pixel, one survives in the reservoir.
+  int candidates = 32;
+  // Reservoirs of random neighbours in the same tile merged into each
+  // pixel's, 0 disables spatial reuse.
+  int spatialSamples = 4;
+  int spatialRadius = 6;
+};
+
+// Thread time of each phase, summed over tiles.
+struct ReSTIRStats {
+  std::atomic<long long> candidateNs{0};
+  std::atomic<long long> spatialNs{0};
+  std::atomic<long long> shadeNs{0};
+  std::atomic<long long> candidates{0};
+  std::atomic<long long> shadowRays{0};
+};
+
+// Adds samplesPerPixel path samples to estimates[i] of every pixels[i] of
+// one tile. The first hit takes its direct light from the reservoir and
+// continues with a BRDF sampled path that ignores emitters it hits. Returns
+// early with partial estimates once token is cancelled.
+void renderReSTIRTile(const Scene &scene, const CameraRays &rays, int width,
+                      const std::vector<int> &pixels, int samplesPerPixel,
+                      int sideSampleCount, const IntegratorSettings &integrator,
+                      const ReSTIRSettings &settings,
+                      std::vector<PixelEstimate> &estimates,
+                      ReSTIRStats &stats, const CancellationToken &token);
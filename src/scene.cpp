@@ -1,7 +1,33 @@
 #include "scene.h"
+#include "instrument.h"
+#include "stats.h"
+#include "timeline.h"
+#include "utils.h"
 
+#include <algorithm>
 #include <string>
 
+namespace {
+
+	bool sameMaterial(const Material& a, const Material& b)
+	{
+		return std::equal(a.albedo.d, a.albedo.d + 3, b.albedo.d) && std::equal(a.emission.d, a.emission.d + 3, b.emission.d) &&
+			a.metallic == b.metallic && a.roughness == b.roughness;
+	}
+}
+
+MaterialRecord compileMaterial(const Material& m, const ShadingRecord& shading)
+{
+	MaterialRecord r;
+	r.emission = m.emission;
+	r.continueProbability = std::max(m.albedo.x(), std::max(m.albedo.y(), m.albedo.z()));
+	r.emissive = math::luminance(m.emission) > 0.0f;
+	// No diffuse albedo and a Fresnel term that is zero from normal to
+	// grazing incidence.
+	r.black = shading.diffuseAverage <= 0.0f && shading.fresnel90 <= 0.0f && math::luminance(shading.specColor) <= 0.0f;
+	return r;
+}
+
 
 Scene::Node::Node(const std::string& n, const std::vector<math::Triangle>& tr) : name(n), triangles(tr)
 { 
@@ -9,29 +35,43 @@ Scene::Node::Node(const std::string& n, const std::vector<math::Triangle>& tr) :
 	{
 		bbox.growTo(t);
 	}
-	bvh.build(triangles);
 }
 
 void Scene::addNode(const std::string& name, const std::vector<math::Triangle>& triangles)
 {
-	nodes_.push_back({ name, triangles });
+	std::vector<math::Triangle> numbered = triangles;
+	for (auto& t : numbered)
+	{
+		if (t.matIndex < materialTable_.size() && materialTable_[t.matIndex].emissive)
+			t.lightIndex = lightCount_++;
+	}
+	nodes_.push_back({ name, numbered });
 }
 
-void Scene::addMaterial(const Material& m)
+std::uint32_t Scene::addMaterial(const Material& m)
 {
+	for (size_t i = 0; i < materials_.size(); ++i)
+	{
+		if (sameMaterial(materials_[i], m))
+			return std::uint32_t(i);
+	}
+
 	materials_.push_back(m);
+	shadingTable_.push_back(makeShadingRecord(m.albedo, m.metallic, m.roughness));
+	materialTable_.push_back(compileMaterial(m, shadingTable_.back()));
+	return std::uint32_t(materials_.size() - 1);
 }
 
-float Scene::intersect(const math::Ray& ray, float tMin, float tMax, math::Triangle& tr) const
+float Scene::intersect(const math::Ray& ray, float tMin, float tMax, math::Triangle& tr, TraversalStats& stats) const
 {
 	float closestT = tMax;
 	float tBox;
 	math::Triangle t;
-	for (const auto& node : nodes_)
+	for (const auto& node : localNodes())
 	{
 		if (math::intersectBB(ray, node.bbox, tMin, tMax, tBox))
 		{
-			float dist = node.bvh.intersect(ray, tMin, closestT, t);
+			float dist = node.bvh.intersect(ray, tMin, closestT, t, stats);
 			if (dist < closestT)
 			{
 				closestT = dist;
@@ -40,4 +80,97 @@ float Scene::intersect(const math::Ray& ray, float tMin, float tMax, math::Trian
 		}
 	}
 	return closestT;
-}
\ No newline at end of file
+}
+
+float Scene::intersect(const math::Ray& ray, float tMin, float tMax, math::Triangle& tr) const
+{
+	TraversalStats stats;
+	const float closestT = intersect(ray, tMin, tMax, tr, stats);
+	addStat(Stat::NodesVisited, stats.nodes);
+	addStat(Stat::TrianglesTested, stats.triangles);
+	PBR_COUNT(BoxTests, stats.nodes);
+	PBR_COUNT(BoxHits, stats.boxHits);
+	PBR_RECORD(NodesPerRay, stats.nodes);
+	PBR_RECORD(TrianglesPerRay, stats.triangles);
+	return closestT;
+}
+
+bool Scene::occluded(const math::Ray& ray, float tMin, float tMax) const
+{
+	float tBox;
+	TraversalStats stats;
+	bool hit = false;
+	for (const auto& node : localNodes())
+	{
+		if (math::intersectBB(ray, node.bbox, tMin, tMax, tBox) && node.bvh.occluded(ray, tMin, tMax, stats))
+		{
+			hit = true;
+			break;
+		}
+	}
+	addStat(Stat::NodesVisited, stats.nodes);
+	addStat(Stat::TrianglesTested, stats.triangles);
+	PBR_COUNT(BoxTests, stats.nodes);
+	PBR_COUNT(BoxHits, stats.boxHits);
+	PBR_RECORD(NodesPerShadowRay, stats.nodes);
+	return hit;
+}
+
+math::BBox Scene::bounds() const
+{
+	math::BBox box;
+	for (const auto& node : nodes_)
+	{
+		box.growTo(node.bbox.min());
+		box.growTo(node.bbox.max());
+	}
+	return box;
+}
+
+void Scene::build(TaskManager& pool)
+{
+	timeline::Scope scope("build scene");
+	TaskGroup group(pool);
+	group.run([this]() {
+		timeline::Scope scope("build lights");
+		std::vector<math::Triangle> triangles;
+		for (const auto& node : nodes_)
+			triangles.insert(triangles.end(), node.triangles.begin(), node.triangles.end());
+		lights_.build(triangles, materials_);
+		});
+	group.runBulk(nodes_.begin(), nodes_.end(), [&pool](Node& node) {
+		timeline::Scope scope("build BVH", node.name.c_str());
+		node.bvh.build(node.triangles, &pool);
+		});
+	group.wait();
+}
+
+void Scene::replicate(TaskManager& pool)
+{
+	replicas_.clear();
+	replicas_.resize(size_t(std::max(0, pool.nodeCount() - 1)));
+	// One node at a time, copying from a thread of the target node places
+	// the pages there on first touch.
+	for (size_t i = 0; i < replicas_.size(); ++i)
+		pool.runOnNode(int(i) + 1, [this, i]() {
+			timeline::Scope scope("replicate scene");
+			// Traversal reads only the bounds and the BVH; the triangle list
+			// that fed the build is not copied.
+			std::vector<Node>& replica = replicas_[i];
+			replica.reserve(nodes_.size());
+			for (const Node& node : nodes_)
+			{
+				replica.emplace_back(node.name, std::vector<math::Triangle>());
+				replica.back().bbox = node.bbox;
+				replica.back().bvh = node.bvh;
+			}
+			});
+}
+
+const std::vector<Scene::Node>& Scene::localNodes() const
+{
+	if (replicas_.empty())
+		return nodes_;
+	const int node = TaskManager::currentNode();
+	return node > 0 && size_t(node) <= replicas_.size() ? replicas_[node - 1] : nodes_;
+}
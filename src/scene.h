@@ -1,8 +1,13 @@
 #pragma once
 
+#include "brdf.h"
 #include "bvh.h"
+#include "environment.h"
+#include "lights.h"
 #include "vector.h"
 
+#include <cstdint>
+#include <utility>
 #include <vector>
 
 struct Material {
@@ -12,6 +17,21 @@ struct Material {
   float roughness;
 };
 
+// Material as the integrators read it, compiled once at load. BRDF
+// constants live in a separate table of cache line sized ShadingRecords,
+// so emission and termination tests do not pull them in.
+struct alignas(32) MaterialRecord {
+  Vector3 emission;
+  // Russian roulette survival probability, the largest albedo channel.
+  float continueProbability;
+  bool emissive;
+  // Reflects nothing, paths end after adding the emission.
+  bool black;
+};
+
+MaterialRecord compileMaterial(const Material &m,
+                               const ShadingRecord &shading);
+
 struct Camera {
   Vector3 pos;
   Vector3 target;
@@ -25,19 +45,52 @@ class Scene {
     Node(const std::string &n, const std::vector<math::Triangle> &tr);
     std::string name;
     math::BBox bbox;
+    // Input of the BVH build, empty in replicas.
     std::vector<math::Triangle> triangles;
 
     BVH<math::Triangle> bvh;
   };
 
+  const std::vector<Node> &localNodes() const;
+
 public:
+  // Materials must be added first, emissive triangles get a light index.
+  // The node is not intersectable until build().
   void addNode(const std::string &name,
                const std::vector<math::Triangle> &triangles);
-  void addMaterial(const Material &m);
+  // Returns the material index for triangles; identical materials share one
+  // entry.
+  std::uint32_t addMaterial(const Material &m);
   const std::vector<Material> &materials() const { return materials_; }
+  const std::vector<MaterialRecord> &materialTable() const {
+    return materialTable_;
+  }
+  const std::vector<ShadingRecord> &shadingTable() const {
+    return shadingTable_;
+  }
 
   float intersect(const math::Ray &ray, float tMin, float tMax,
                   math::Triangle &tr) const;
+  // Adds the traversal work to stats instead of the render statistics, for
+  // rays that are not part of the image.
+  float intersect(const math::Ray &ray, float tMin, float tMax,
+                  math::Triangle &tr, TraversalStats &stats) const;
+  bool occluded(const math::Ray &ray, float tMin, float tMax) const;
+  math::BBox bounds() const;
+
+  // Builds the BVH of every node and the light hierarchy on the pool, call
+  // once nodes and materials are added.
+  void build(TaskManager &pool);
+  // Copies the node BVHs into the memory of every other NUMA node of the
+  // pool, so its workers traverse a local copy. Call after build().
+  void replicate(TaskManager &pool);
+  const LightSampler &lights() const { return lights_; }
+
+  void setEnvironment(EnvironmentMap environment) {
+    environment_ = std::move(environment);
+  }
+  // Radiance of rays that leave the scene, empty for black.
+  const EnvironmentMap &environment() const { return environment_; }
 
   void setCamera(const Camera &camera) { camera_ = camera; }
   const Camera &camera() const { return camera_; }
@@ -45,5 +98,12 @@ public:
 private:
   Camera camera_;
   std::vector<Node> nodes_;
+  // Copies of nodes_ for NUMA nodes 1 and up of the render pool.
+  std::vector<std::vector<Node>> replicas_;
   std::vector<Material> materials_;
+  std::vector<MaterialRecord> materialTable_;
+  std::vector<ShadingRecord> shadingTable_;
+  LightSampler lights_;
+  std::int32_t lightCount_ = 0;
+  EnvironmentMap environment_;
 };
\ No newline at end of file
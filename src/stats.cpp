@@ -0,0 +1,51 @@
+#include "stats.h"
+
+namespace {
+
+	std::atomic<StatsShard*> shards{ nullptr };
+}
+
+StatsShard& detail::registerStatsShard()
+{
+	// Shards are only ever pushed, readers walking the list never see one
+	// go away.
+	StatsShard* shard = new StatsShard();
+	StatsShard* head = shards.load(std::memory_order_relaxed);
+	do
+		shard->next = head;
+	while (!shards.compare_exchange_weak(head, shard, std::memory_order_release, std::memory_order_relaxed));
+
+	statsShard = shard;
+	return *shard;
+}
+
+StatsSnapshot StatsSnapshot::take()
+{
+	StatsSnapshot snapshot;
+	for (const StatsShard* shard = shards.load(std::memory_order_acquire); shard; shard = shard->next)
+	{
+		for (int i = 0; i < STAT_COUNT; ++i)
+			snapshot.values[i] += shard->values[i].load(std::memory_order_relaxed);
+	}
+	return snapshot;
+}
+
+StatsSnapshot StatsSnapshot::operator-(const StatsSnapshot& other) const
+{
+	StatsSnapshot difference;
+	for (int i = 0; i < STAT_COUNT; ++i)
+		difference.values[i] = values[i] - other.values[i];
+	return difference;
+}
+
+std::uint64_t StatsSnapshot::rays() const
+{
+	return (*this)[Stat::PrimaryRays] + (*this)[Stat::SecondaryRays] + (*this)[Stat::ShadowRays];
+}
+
+const char* statName(Stat stat)
+{
+	static const char* const names[STAT_COUNT] = { "primary_rays", "secondary_rays", "shadow_rays", "nodes_visited", "triangles_tested", "samples", "cache_lookups",
+		"cache_hits" };
+	return names[int(stat)];
+}
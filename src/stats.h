@@ -0,0 +1,64 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// Render counters, kept per thread. A thread only writes its own shard,
+// with a relaxed load and store instead of a locked add, and readers sum
+// the shards at any time without locks.
+enum class Stat {
+  PrimaryRays,
+  SecondaryRays,
+  ShadowRays,
+  NodesVisited,
+  TrianglesTested,
+  Samples,
+  CacheLookups,
+  CacheHits
+};
+constexpr int STAT_COUNT = 8;
+
+struct alignas(64) StatsShard {
+  std::atomic<std::uint64_t> values[STAT_COUNT]{};
+  // Next shard of the registry. Shards outlive their threads, so totals
+  // keep what exited threads counted.
+  StatsShard *next = nullptr;
+};
+
+namespace detail {
+
+StatsShard &registerStatsShard();
+inline thread_local StatsShard *statsShard = nullptr;
+
+} // namespace detail
+
+inline void addStat(Stat stat, std::uint64_t count = 1) {
+  StatsShard *shard = detail::statsShard;
+  if (!shard)
+    shard = &detail::registerStatsShard();
+  std::atomic<std::uint64_t> &value = shard->values[int(stat)];
+  value.store(value.load(std::memory_order_relaxed) + count,
+              std::memory_order_relaxed);
+}
+
+// Count of the calling thread alone, so it can measure its own work.
+inline std::uint64_t localStat(Stat stat) {
+  const StatsShard *shard = detail::statsShard;
+  return shard ? shard->values[int(stat)].load(std::memory_order_relaxed) : 0;
+}
+
+// Totals over every thread. Differences of two snapshots give the counts
+// of the work in between.
+struct StatsSnapshot {
+  std::uint64_t values[STAT_COUNT] = {};
+
+  static StatsSnapshot take();
+
+  std::uint64_t operator[](Stat stat) const { return values[int(stat)]; }
+  StatsSnapshot operator-(const StatsSnapshot &other) const;
+  // Primary, secondary and shadow rays.
+  std::uint64_t rays() const;
+};
+
+// snake_case name, used as the JSON key.
+const char *statName(Stat stat);
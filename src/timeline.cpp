@@ -0,0 +1,145 @@
+#include "timeline.h"
+
+#include <cstdio>
+#include <cstring>
+#include <memory>
+
+namespace {
+
+	struct Event
+	{
+		const char* name;
+		std::int64_t start;
+		std::int64_t end;
+		char detail[48];
+	};
+
+	// Written only by its thread; count is published with release so the
+	// writer sees complete events.
+	struct Buffer
+	{
+		std::unique_ptr<Event[]> events;
+		size_t mask = 0;
+		std::atomic<std::uint64_t> count{ 0 };
+		int thread = 0;
+		std::string name;
+		Buffer* next = nullptr;
+	};
+
+	std::atomic<Buffer*> buffers{ nullptr };
+	std::atomic<int> threadCount{ 0 };
+	size_t bufferSize = 0;
+	std::int64_t origin = 0;
+
+	thread_local Buffer* localBuffer = nullptr;
+	thread_local std::string threadName;
+
+	Buffer& buffer()
+	{
+		if (localBuffer)
+			return *localBuffer;
+
+		Buffer* b = new Buffer();
+		b->events.reset(new Event[bufferSize]);
+		b->mask = bufferSize - 1;
+		b->thread = threadCount.fetch_add(1, std::memory_order_relaxed) + 1;
+		b->name = threadName.empty() ? "thread " + std::to_string(b->thread) : threadName;
+
+		Buffer* head = buffers.load(std::memory_order_relaxed);
+		do
+			b->next = head;
+		while (!buffers.compare_exchange_weak(head, b, std::memory_order_release, std::memory_order_relaxed));
+
+		localBuffer = b;
+		return *b;
+	}
+
+	void writeString(FILE* file, const char* s)
+	{
+		fputc('"', file);
+		for (; *s; ++s)
+		{
+			const unsigned char c = (unsigned char)*s;
+			if (c == '"' || c == '\\')
+				fprintf(file, "\\%c", c);
+			else if (c < 0x20)
+				fprintf(file, "\\u%04x", c);
+			else
+				fputc(c, file);
+		}
+		fputc('"', file);
+	}
+}
+
+void timeline::detail::record(const char* name, const char* detail, std::int64_t start, std::int64_t end)
+{
+	Buffer& b = buffer();
+	const std::uint64_t count = b.count.load(std::memory_order_relaxed);
+	Event& e = b.events[count & b.mask];
+	e.name = name;
+	e.start = start;
+	e.end = end;
+	e.detail[0] = '\0';
+	if (detail)
+	{
+		std::strncpy(e.detail, detail, sizeof(e.detail) - 1);
+		e.detail[sizeof(e.detail) - 1] = '\0';
+	}
+	b.count.store(count + 1, std::memory_order_release);
+}
+
+void timeline::start(size_t eventsPerThread)
+{
+	if (recording())
+		return;
+
+	bufferSize = 1;
+	while (bufferSize < eventsPerThread)
+		bufferSize *= 2;
+	origin = detail::now();
+	detail::recording.store(true, std::memory_order_release);
+}
+
+void timeline::setThreadName(const std::string& name)
+{
+	threadName = name;
+	if (localBuffer)
+		localBuffer->name = name;
+}
+
+bool timeline::write(const char* path)
+{
+	FILE* file = std::fopen(path, "w");
+	if (!file)
+		return false;
+
+	fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+	bool first = true;
+	for (Buffer* b = buffers.load(std::memory_order_acquire); b; b = b->next)
+	{
+		fprintf(file, "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": ", first ? "" : ",", b->thread);
+		writeString(file, b->name.c_str());
+		fprintf(file, "}}");
+		first = false;
+
+		const std::uint64_t count = b->count.load(std::memory_order_acquire);
+		const std::uint64_t begin = count > b->mask + 1 ? count - (b->mask + 1) : 0;
+		for (std::uint64_t i = begin; i < count; ++i)
+		{
+			const Event& e = b->events[i & b->mask];
+			fprintf(file, ",\n{\"name\": ");
+			writeString(file, e.name);
+			fprintf(file, ", \"cat\": \"pbr\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f", b->thread,
+				(e.start - origin) * 1e-3, (e.end - e.start) * 1e-3);
+			if (e.detail[0])
+			{
+				fprintf(file, ", \"args\": {\"detail\": ");
+				writeString(file, e.detail);
+				fprintf(file, "}");
+			}
+			fprintf(file, "}");
+		}
+	}
+	fprintf(file, "\n]}\n");
+	return std::fclose(file) == 0;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Optional timeline of loading, building and rendering in Chrome
+// trace_event JSON, for chrome://tracing or Perfetto. Each thread records
+// complete events into its own ring buffer, overwriting the oldest once it
+// is full. While not recording, a scope costs one relaxed load.
+namespace timeline {
+
+namespace detail {
+
+inline std::atomic<bool> recording{false};
+
+inline std::int64_t now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+void record(const char *name, const char *detail, std::int64_t start,
+            std::int64_t end);
+
+} // namespace detail
+
+// Starts recording; eventsPerThread is rounded up to a power of two.
+void start(size_t eventsPerThread = size_t(1) << 16);
+inline bool recording() {
+  return detail::recording.load(std::memory_order_relaxed);
+}
+// Writes every recorded event. Call while no thread records, the threads
+// must have synchronised with the caller since their last event.
+bool write(const char *path);
+// Name of the calling thread in the timeline.
+void setThreadName(const std::string &name);
+
+// One event for the lifetime of the scope. name must be a literal, detail
+// is copied when the scope ends and may be null.
+class Scope {
+public:
+  explicit Scope(const char *name, const char *detail = nullptr)
+      : name_(name), detail_(detail),
+        start_(recording() ? detail::now() : -1) {}
+  ~Scope() {
+    if (start_ >= 0)
+      detail::record(name_, detail_, start_, detail::now());
+  }
+
+  Scope(const Scope &) = delete;
+  Scope &operator=(const Scope &) = delete;
+
+private:
+  const char *name_;
+  const char *detail_;
+  std::int64_t start_;
+};
+
+} // namespace timeline
@@ -0,0 +1,129 @@
+#include "topology.h"
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace {
+
+	bool readLine(const std::string& path, std::string& line)
+	{
+		std::ifstream file(path);
+		return file.is_open() && std::getline(file, line);
+	}
+
+	// CPUs of the process affinity mask, empty if unknown.
+	std::vector<int> allowedCpus()
+	{
+		std::vector<int> cpus;
+#ifdef __linux__
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		if (sched_getaffinity(0, sizeof(set), &set) == 0)
+		{
+			for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+			{
+				if (CPU_ISSET(cpu, &set))
+					cpus.push_back(cpu);
+			}
+		}
+#endif
+		return cpus;
+	}
+}
+
+std::vector<int> parseCpuList(const std::string& list)
+{
+	std::vector<int> cpus;
+	std::stringstream stream(list);
+	std::string range;
+	while (std::getline(stream, range, ','))
+	{
+		int first = 0, last = 0;
+		const size_t dash = range.find('-');
+		try
+		{
+			first = std::stoi(range.substr(0, dash));
+			last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+		}
+		catch (const std::exception&)
+		{
+			continue;
+		}
+		for (int cpu = first; cpu <= last; ++cpu)
+			cpus.push_back(cpu);
+	}
+	return cpus;
+}
+
+CpuTopology CpuTopology::detect()
+{
+	CpuTopology topology;
+	const std::vector<int> allowed = allowedCpus();
+	auto isAllowed = [&](int cpu) { return allowed.empty() || std::find(allowed.begin(), allowed.end(), cpu) != allowed.end(); };
+
+	std::string line;
+	if (readLine("/sys/devices/system/node/online", line))
+	{
+		for (int id : parseCpuList(line))
+		{
+			std::string cpus;
+			if (!readLine("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist", cpus))
+				continue;
+
+			Node node{ id, {} };
+			for (int cpu : parseCpuList(cpus))
+			{
+				if (isAllowed(cpu))
+					node.cpus.push_back(cpu);
+			}
+			if (!node.cpus.empty())
+				topology.nodes.push_back(std::move(node));
+		}
+	}
+
+	if (topology.nodes.empty())
+	{
+		Node node{ 0, allowed };
+		if (node.cpus.empty())
+		{
+			const int count = std::max(1, int(std::thread::hardware_concurrency()));
+			for (int cpu = 0; cpu < count; ++cpu)
+				node.cpus.push_back(cpu);
+		}
+		topology.nodes.push_back(std::move(node));
+	}
+	return topology;
+}
+
+int CpuTopology::cpuCount() const
+{
+	int count = 0;
+	for (const Node& node : nodes)
+		count += int(node.cpus.size());
+	return count;
+}
+
+bool pinCurrentThread(const std::vector<int>& cpus)
+{
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int cpu : cpus)
+	{
+		if (cpu >= 0 && cpu < CPU_SETSIZE)
+			CPU_SET(cpu, &set);
+	}
+	return !cpus.empty() && pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+	(void)cpus;
+	return false;
+#endif
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+// CPUs the process may run on, grouped by NUMA node.
+struct CpuTopology {
+  struct Node {
+    int id;
+    std::vector<int> cpus;
+  };
+
+  std::vector<Node> nodes;
+
+  // Reads /sys/devices/system/node on Linux, restricted to the affinity
+  // mask of the process. Elsewhere, or if nothing can be read, one node
+  // with hardware_concurrency CPUs.
+  static CpuTopology detect();
+
+  int cpuCount() const;
+};
+
+// Parses a kernel CPU list such as "0-3,8-11".
+std::vector<int> parseCpuList(const std::string &list);
+
+// Restricts the calling thread to cpus, false where unsupported.
+bool pinCurrentThread(const std::vector<int> &cpus);
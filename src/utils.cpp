@@ -1,5 +1,6 @@
 #include "utils.h"
 
+#include <atomic>
 #include <random>
 
 namespace math {
@@ -140,8 +141,11 @@ namespace math {
 
 float randomFloat()
 {
-	static std::uniform_real_distribution<float> distribution(0.0, 1.0);
-	static std::mt19937 generator;
+	// One generator per thread: a shared one is a data race and its state
+	// bounces between cores on every sample.
+	static std::atomic<std::uint32_t> seed{ 0 };
+	thread_local std::uniform_real_distribution<float> distribution(0.0, 1.0);
+	thread_local std::mt19937 generator(std::mt19937::default_seed + seed.fetch_add(1));
 	return distribution(generator);
 }
 
@@ -2,6 +2,8 @@
 
 #include "vector.h"
 
+#include <cstdint>
+
 constexpr float PI = 3.14159265359f;
 constexpr float INV_PI = 1.0f / PI;
 constexpr float EPS = 0.00000001f;
@@ -17,6 +19,8 @@ namespace math {
 		Vector3 nb;
 		Vector3 nc;
 		size_t matIndex;
+		// Index into the light sampler for emissive triangles, otherwise -1.
+		std::int32_t lightIndex = -1;
 	};
 
 	struct Sphere
@@ -68,6 +72,10 @@ namespace math {
 		return a + (b - a) * t;
 	}
 
+	inline float luminance(const Vector3& color) {
+		return 0.2126f * color.x() + 0.7152f * color.y() + 0.0722f * color.z();
+	}
+
 	float intersectPlane2(const Ray& ray, const Vector3& normal, float d, float tMin, float tMax);
 	float intersect(const Ray& ray, const Triangle& tr, float tMin, float tMax);
 	float intersect(const Ray& ray, const Sphere& sp, float tMin, float tMax);
@@ -0,0 +1,441 @@
+#include "wavefront.h"
+
+#include "concurrency.h"
+#include "render.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <chrono>
+
+namespace {
+
+	constexpr size_t CHUNK_SIZE = 4096;
+
+	// Per-chunk output of a stage, appended to the shared queue in one step.
+	struct LocalRays
+	{
+		std::vector<math::Ray> rays;
+		std::vector<std::uint32_t> path;
+
+		void flush(RayQueue& queue)
+		{
+			const size_t base = queue.size.fetch_add(rays.size());
+			for (size_t i = 0; i < rays.size(); ++i)
+				queue.set(base + i, rays[i], path[i]);
+		}
+	};
+
+	struct LocalShadows
+	{
+		LocalRays rays;
+		std::vector<float> distance;
+		std::vector<Vector3> contribution;
+
+		void flush(ShadowQueue& queue)
+		{
+			const size_t base = queue.rays.size.fetch_add(rays.rays.size());
+			for (size_t i = 0; i < rays.rays.size(); ++i)
+			{
+				queue.rays.set(base + i, rays.rays[i], rays.path[i]);
+				queue.distance[base + i] = distance[i];
+				queue.cr[base + i] = contribution[i].x();
+				queue.cg[base + i] = contribution[i].y();
+				queue.cb[base + i] = contribution[i].z();
+			}
+		}
+	};
+
+	class StageTimer
+	{
+	public:
+		explicit StageTimer(double& ms) : ms_(ms), start_(std::chrono::steady_clock::now()) {}
+		~StageTimer()
+		{
+			ms_ += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start_).count();
+		}
+
+	private:
+		double& ms_;
+		std::chrono::steady_clock::time_point start_;
+	};
+}
+
+void RayQueue::resize(size_t capacity)
+{
+	for (auto* v : { &ox, &oy, &oz, &dx, &dy, &dz })
+		v->resize(capacity);
+	path.resize(capacity);
+	size = 0;
+}
+
+math::Ray RayQueue::ray(size_t i) const
+{
+	return math::Ray({ Vector3(ox[i], oy[i], oz[i]), Vector3(dx[i], dy[i], dz[i]) });
+}
+
+void RayQueue::set(size_t i, const math::Ray& ray, std::uint32_t pathIndex)
+{
+	ox[i] = ray.origin.x();
+	oy[i] = ray.origin.y();
+	oz[i] = ray.origin.z();
+	dx[i] = ray.direction.x();
+	dy[i] = ray.direction.y();
+	dz[i] = ray.direction.z();
+	path[i] = pathIndex;
+}
+
+void RayQueue::swap(RayQueue& other)
+{
+	ox.swap(other.ox);
+	oy.swap(other.oy);
+	oz.swap(other.oz);
+	dx.swap(other.dx);
+	dy.swap(other.dy);
+	dz.swap(other.dz);
+	path.swap(other.path);
+	size = other.size.exchange(size.load());
+}
+
+void HitQueue::resize(size_t capacity)
+{
+	for (auto* v : { &t, &nx, &ny, &nz, &lightPdf })
+		v->resize(capacity);
+	material.resize(capacity);
+}
+
+void ShadowQueue::resize(size_t capacity)
+{
+	rays.resize(capacity);
+	for (auto* v : { &distance, &cr, &cg, &cb })
+		v->resize(capacity);
+}
+
+void PathStates::resize(size_t capacity)
+{
+	for (auto* v : { &tr, &tg, &tb, &lr, &lg, &lb, &lastPdf })
+		v->resize(capacity);
+}
+
+WavefrontIntegrator::WavefrontIntegrator(const Scene& scene, const CameraRays& rays, const IntegratorSettings& settings, const RaySortSettings& sorting, TaskManager& pool)
+	: scene_(scene), rays_(rays), settings_(settings), sorting_(sorting), bounds_(scene.bounds()), pool_(pool)
+{
+}
+
+template <typename Fn>
+void WavefrontIntegrator::parallel(size_t count, const Fn& fn)
+{
+	parallelFor(pool_, 0, count, CHUNK_SIZE, fn);
+}
+
+void WavefrontIntegrator::render(const std::vector<int>& pixels, int samples, int width, int sideSampleCount, std::vector<PixelEstimate>& film)
+{
+	const size_t count = pixels.size() * samples;
+	if (count == 0)
+		return;
+
+	paths_.resize(count);
+	queue_.resize(count);
+	next_.resize(count);
+	hits_.resize(count);
+	if (sorting_.enabled && sorting_.benchmark)
+		benchmarkHits_.resize(count);
+	shadows_.resize(count);
+
+	generate(pixels, samples, width, sideSampleCount, film);
+
+	for (int depth = 0; queue_.size > 0; ++depth)
+	{
+		if (depth > 0 && sorting_.enabled)
+		{
+			// The benchmark alternates which order is traced first, so neither
+			// always runs on the caches the other warmed up. After sorting,
+			// next_ still holds the rays in their original order.
+			const bool benchmark = sorting_.benchmark;
+			const bool unsortedFirst = benchmark && (benchmarkPasses_++ & 1) == 0;
+			if (unsortedFirst)
+				benchmarkUnsorted(queue_, queue_.size, depth);
+			sortQueue();
+			extend(depth);
+			if (benchmark && !unsortedFirst)
+				benchmarkUnsorted(next_, queue_.size, depth);
+		}
+		else
+			extend(depth);
+		shade(depth);
+		shadow();
+
+		queue_.swap(next_);
+		next_.size = 0;
+	}
+
+	accumulate(pixels, samples, film);
+	stats_.paths += (long long)count;
+}
+
+void WavefrontIntegrator::generate(const std::vector<int>& pixels, int samples, int width, int sideSampleCount, const std::vector<PixelEstimate>& film)
+{
+	StageTimer timer(stats_.generateMs);
+
+	const int strata = sideSampleCount * sideSampleCount;
+	const size_t count = pixels.size() * samples;
+
+	parallel(count, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i)
+		{
+			const int pixel = pixels[i / samples];
+			const int s = (film[pixel].samples + int(i % samples)) % strata;
+			const Vector3 offset = getUniformSampleOffset(s, sideSampleCount);
+
+			queue_.set(i, rays_.generate(pixel % width, pixel / width, offset), std::uint32_t(i));
+
+			paths_.tr[i] = paths_.tg[i] = paths_.tb[i] = 1.0f;
+			paths_.lr[i] = paths_.lg[i] = paths_.lb[i] = 0.0f;
+			paths_.lastPdf[i] = 0.0f;
+		}
+		});
+	queue_.size = count;
+}
+
+void WavefrontIntegrator::extend(int depth)
+{
+	double ms = 0.0;
+	{
+		StageTimer timer(ms);
+		intersect(queue_, queue_.size, hits_, depth, true);
+	}
+
+	stats_.extendMs += ms;
+	stats_.extensionRays += (long long)queue_.size.load();
+	addStat(depth == 0 ? Stat::PrimaryRays : Stat::SecondaryRays, queue_.size.load());
+	if (depth > 0)
+	{
+		stats_.secondaryExtendMs += ms;
+		stats_.secondaryRays += (long long)queue_.size.load();
+	}
+}
+
+void WavefrontIntegrator::benchmarkUnsorted(const RayQueue& rays, size_t count, int depth)
+{
+	StageTimer timer(stats_.unsortedExtendMs);
+	intersect(rays, count, benchmarkHits_, depth, false);
+}
+
+void WavefrontIntegrator::intersect(const RayQueue& rays, size_t count, HitQueue& hits, int depth, bool counted)
+{
+	parallel(count, [&](size_t begin, size_t end) {
+		TraversalStats uncounted;
+		for (size_t i = begin; i < end; ++i)
+		{
+			const math::Ray ray = rays.ray(i);
+
+			math::Triangle tr;
+			const float t = counted ? scene_.intersect(ray, RAY_T_MIN, RAY_T_MAX, tr) : scene_.intersect(ray, RAY_T_MIN, RAY_T_MAX, tr, uncounted);
+			if (t >= RAY_T_MAX)
+			{
+				hits.material[i] = -1;
+				hits.lightPdf[i] = settings_.nee && depth > 0 ? environmentPdf(scene_, ray.direction) : 0.0f;
+				continue;
+			}
+
+			const Vector3 hitPoint = ray.origin + ray.direction * t;
+			Vector3 n = interpolatedNormal(tr, hitPoint);
+			if (dot(n, ray.direction) > 0.0f)
+				n = -n;
+
+			const bool emissive = scene_.materialTable()[tr.matIndex].emissive;
+
+			hits.t[i] = t;
+			hits.nx[i] = n.x();
+			hits.ny[i] = n.y();
+			hits.nz[i] = n.z();
+			hits.material[i] = std::int32_t(tr.matIndex);
+			hits.lightPdf[i] = settings_.nee && depth > 0 && emissive ? emitterPdf(scene_, tr, ray, t) : 0.0f;
+		}
+		});
+}
+
+void WavefrontIntegrator::sortQueue()
+{
+	StageTimer timer(stats_.sortMs);
+
+	const size_t count = queue_.size;
+	const Vector3 lo = bounds_.min();
+	const Vector3 size = bounds_.size();
+	const Vector3 scale(size.x() > 0.0f ? 1023.0f / size.x() : 0.0f, size.y() > 0.0f ? 1023.0f / size.y() : 0.0f, size.z() > 0.0f ? 1023.0f / size.z() : 0.0f);
+
+	auto spread = [](std::uint64_t v) {
+		v &= 0x3ff;
+		v = (v | (v << 16)) & 0x30000ff;
+		v = (v | (v << 8)) & 0x300f00f;
+		v = (v | (v << 4)) & 0x30c30c3;
+		v = (v | (v << 2)) & 0x9249249;
+		return v;
+	};
+
+	// Direction octant in the top bits, then a 30 bit Morton code of the
+	// origin inside the scene bounds.
+	sortKeys_.resize(count);
+	parallel(count, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i)
+		{
+			const std::uint64_t x = (std::uint64_t)std::clamp((queue_.ox[i] - lo.x()) * scale.x(), 0.0f, 1023.0f);
+			const std::uint64_t y = (std::uint64_t)std::clamp((queue_.oy[i] - lo.y()) * scale.y(), 0.0f, 1023.0f);
+			const std::uint64_t z = (std::uint64_t)std::clamp((queue_.oz[i] - lo.z()) * scale.z(), 0.0f, 1023.0f);
+			const std::uint64_t octant = (queue_.dx[i] < 0.0f ? 1 : 0) | (queue_.dy[i] < 0.0f ? 2 : 0) | (queue_.dz[i] < 0.0f ? 4 : 0);
+
+			sortKeys_[i] = { (octant << 30) | spread(x) | (spread(y) << 1) | (spread(z) << 2), std::uint32_t(i) };
+		}
+		});
+
+	const size_t window = std::max<size_t>(1, sorting_.batchSize);
+	const size_t windows = (count + window - 1) / window;
+	// One task per window; the chunked parallel() would put all of them in one.
+	parallelFor(pool_, 0, windows, 1, [&](size_t begin, size_t end) {
+		for (size_t w = begin; w < end; ++w)
+			std::sort(sortKeys_.begin() + w * window, sortKeys_.begin() + std::min(count, (w + 1) * window));
+		});
+
+	parallel(count, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i)
+			next_.set(i, queue_.ray(sortKeys_[i].second), queue_.path[sortKeys_[i].second]);
+		});
+
+	next_.size = count;
+	queue_.swap(next_);
+	next_.size = 0;
+}
+
+void WavefrontIntegrator::shade(int depth)
+{
+	StageTimer timer(stats_.shadeMs);
+	shadows_.rays.size = 0;
+
+	parallel(queue_.size, [&](size_t begin, size_t end) {
+		LocalRays next;
+		LocalShadows shadows;
+
+		// Light connections of the chunk, BRDF evaluated in one batch.
+		BRDFBatch batch;
+		std::vector<LightConnection> lights;
+		std::vector<Vector3> throughputs;
+
+		for (size_t i = begin; i < end; ++i)
+		{
+			const std::uint32_t p = queue_.path[i];
+			if (hits_.material[i] < 0)
+			{
+				Vector3 background = scene_.environment().eval(queue_.ray(i).direction);
+				if (hits_.lightPdf[i] > 0.0f)
+					background = background * powerHeuristic(paths_.lastPdf[p], hits_.lightPdf[i]);
+				paths_.lr[p] += paths_.tr[p] * background.x();
+				paths_.lg[p] += paths_.tg[p] * background.y();
+				paths_.lb[p] += paths_.tb[p] * background.z();
+				continue;
+			}
+
+			const MaterialRecord& m = scene_.materialTable()[hits_.material[i]];
+			const ShadingRecord& shading = scene_.shadingTable()[hits_.material[i]];
+			const math::Ray ray = queue_.ray(i);
+			const Vector3 hitPoint = ray.origin + ray.direction * hits_.t[i];
+			const Vector3 N(hits_.nx[i], hits_.ny[i], hits_.nz[i]);
+			const Vector3 V = ray.direction * -1.0f;
+
+			Vector3 throughput(paths_.tr[p], paths_.tg[p], paths_.tb[p]);
+
+			Vector3 emission = m.emission;
+			if (hits_.lightPdf[i] > 0.0f)
+				emission = emission * powerHeuristic(paths_.lastPdf[p], hits_.lightPdf[i]);
+			paths_.lr[p] += throughput.x() * emission.x();
+			paths_.lg[p] += throughput.y() * emission.y();
+			paths_.lb[p] += throughput.z() * emission.z();
+
+			if (m.black)
+				continue;
+
+			if (depth > settings_.maxDepth)
+			{
+				const float probToContinue = m.continueProbability;
+				if (randFloat(0, 1) > probToContinue)
+					continue;
+				throughput = throughput * (1.0f / probToContinue);
+			}
+
+			LightConnection light;
+			if (settings_.nee && connectLight(scene_, hitPoint, N, light))
+			{
+				batch.push(light.shadowRay.direction, V, N, std::uint32_t(hits_.material[i]));
+				lights.push_back(light);
+				throughputs.push_back(throughput);
+				shadows.rays.path.push_back(p);
+			}
+
+			const ScatterSample s = sampleScatter(shading, N, V);
+			throughput = throughput * s.weight;
+			if (throughput.x() <= 0.0f && throughput.y() <= 0.0f && throughput.z() <= 0.0f)
+				continue;
+
+			paths_.tr[p] = throughput.x();
+			paths_.tg[p] = throughput.y();
+			paths_.tb[p] = throughput.z();
+			paths_.lastPdf[p] = s.pdf;
+
+			next.rays.push_back(math::Ray({ hitPoint + s.direction * 1e-4f, s.direction }));
+			next.path.push_back(p);
+		}
+
+		evalBRDF(scene_.shadingTable().data(), batch);
+		for (size_t k = 0; k < lights.size(); ++k)
+		{
+			const LightConnection& light = lights[k];
+			const Vector3 N(batch.nx[k], batch.ny[k], batch.nz[k]);
+			const Vector3 V(batch.vx[k], batch.vy[k], batch.vz[k]);
+			const Vector3 f(batch.r[k], batch.g[k], batch.b[k]);
+			const float weight = powerHeuristic(light.pdf, scatterPdf(scene_.shadingTable()[batch.record[k]], N, V, light.shadowRay.direction));
+
+			shadows.rays.rays.push_back(light.shadowRay);
+			shadows.distance.push_back(light.distance);
+			shadows.contribution.push_back(throughputs[k] * f * light.emission * (weight / light.pdf));
+		}
+
+		next.flush(next_);
+		shadows.flush(shadows_);
+		});
+}
+
+void WavefrontIntegrator::shadow()
+{
+	StageTimer timer(stats_.shadowMs);
+	stats_.shadowRays += (long long)shadows_.rays.size.load();
+	addStat(Stat::ShadowRays, shadows_.rays.size.load());
+
+	parallel(shadows_.rays.size, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i)
+		{
+			if (scene_.occluded(shadows_.rays.ray(i), RAY_T_MIN, shadows_.distance[i] - RAY_T_MIN))
+				continue;
+
+			// Every path has at most one shadow ray per bounce.
+			const std::uint32_t p = shadows_.rays.path[i];
+			paths_.lr[p] += shadows_.cr[i];
+			paths_.lg[p] += shadows_.cg[i];
+			paths_.lb[p] += shadows_.cb[i];
+		}
+		});
+}
+
+void WavefrontIntegrator::accumulate(const std::vector<int>& pixels, int samples, std::vector<PixelEstimate>& film)
+{
+	StageTimer timer(stats_.accumulateMs);
+
+	parallel(pixels.size(), [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; ++i)
+		{
+			PixelEstimate& pixel = film[pixels[i]];
+			for (int s = 0; s < samples; ++s)
+			{
+				const size_t p = i * samples + s;
+				pixel.add(Vector3(paths_.lr[p], paths_.lg[p], paths_.lb[p]));
+			}
+		}
+		});
+}
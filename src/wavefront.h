@@ -0,0 +1,130 @@
+#pragma once
+
+#include "integrator.h"
+#include "scene.h"
+#include "vector.h"
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+class CameraRays;
+struct PixelEstimate;
+
+// Rays in structure-of-arrays form. Stages append in chunks, so size is
+// reserved atomically.
+struct RayQueue {
+  std::vector<float> ox, oy, oz;
+  std::vector<float> dx, dy, dz;
+  std::vector<std::uint32_t> path;
+  std::atomic<size_t> size{0};
+
+  void resize(size_t capacity);
+  math::Ray ray(size_t i) const;
+  void set(size_t i, const math::Ray &ray, std::uint32_t pathIndex);
+  void swap(RayQueue &other);
+};
+
+struct HitQueue {
+  std::vector<float> t;
+  std::vector<float> nx, ny, nz;
+  std::vector<std::int32_t> material;
+  // Light sampling density of the emitter that was hit, for MIS.
+  std::vector<float> lightPdf;
+
+  void resize(size_t capacity);
+};
+
+struct ShadowQueue {
+  RayQueue rays;
+  std::vector<float> distance;
+  std::vector<float> cr, cg, cb;
+
+  void resize(size_t capacity);
+};
+
+struct PathStates {
+  std::vector<float> tr, tg, tb;
+  std::vector<float> lr, lg, lb;
+  std::vector<float> lastPdf;
+
+  void resize(size_t capacity);
+};
+
+struct RaySortSettings {
+  // Sort secondary rays by direction octant and origin cell before extend.
+  bool enabled = false;
+  // Rays sorted together; larger windows find more coherence but cost more.
+  int batchSize = 1 << 16;
+  // Also extend every sorted queue unsorted to measure the speedup.
+  bool benchmark = false;
+};
+
+struct WavefrontStats {
+  double generateMs = 0.0;
+  double extendMs = 0.0;
+  double shadeMs = 0.0;
+  double shadowMs = 0.0;
+  double accumulateMs = 0.0;
+  long long paths = 0;
+  long long extensionRays = 0;
+  long long shadowRays = 0;
+
+  // Bounces after the first, where sorting applies.
+  double secondaryExtendMs = 0.0;
+  long long secondaryRays = 0;
+  double sortMs = 0.0;
+  double unsortedExtendMs = 0.0;
+};
+
+// Path tracer split into batched stages: generate camera rays, extend
+// (closest hit), shade (emission, light sample and BRDF sample), shadow
+// (occlusion) and accumulate. Each stage runs in parallel over its queue.
+class WavefrontIntegrator {
+public:
+  WavefrontIntegrator(const Scene &scene, const CameraRays &rays,
+                      const IntegratorSettings &settings,
+                      const RaySortSettings &sorting, TaskManager &pool);
+
+  // Traces `samples` paths for each listed pixel and adds them to film.
+  void render(const std::vector<int> &pixels, int samples, int width,
+              int sideSampleCount, std::vector<PixelEstimate> &film);
+
+  const WavefrontStats &stats() const { return stats_; }
+
+private:
+  template <typename Fn> void parallel(size_t count, const Fn &fn);
+
+  void generate(const std::vector<int> &pixels, int samples, int width,
+                int sideSampleCount, const std::vector<PixelEstimate> &film);
+  void extend(int depth);
+  // Closest hits of the first count rays into hits. Uncounted traversal
+  // stays out of the render statistics.
+  void intersect(const RayQueue &rays, size_t count, HitQueue &hits,
+                 int depth, bool counted);
+  void benchmarkUnsorted(const RayQueue &rays, size_t count, int depth);
+  void sortQueue();
+  void shade(int depth);
+  void shadow();
+  void accumulate(const std::vector<int> &pixels, int samples,
+                  std::vector<PixelEstimate> &film);
+
+  const Scene &scene_;
+  const CameraRays &rays_;
+  IntegratorSettings settings_;
+  RaySortSettings sorting_;
+  math::BBox bounds_;
+  TaskManager &pool_;
+
+  PathStates paths_;
+  RayQueue queue_;
+  RayQueue next_;
+  HitQueue hits_;
+  // Scratch hits of the unsorted benchmark pass.
+  HitQueue benchmarkHits_;
+  long long benchmarkPasses_ = 0;
+  ShadowQueue shadows_;
+  std::vector<std::pair<std::uint64_t, std::uint32_t>> sortKeys_;
+
+  WavefrontStats stats_;
+};